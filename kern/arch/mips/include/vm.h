@@ -124,13 +124,17 @@ paddr_t ram_getfirstfree(void);
  * TLB shootdown bits.
  *
  * We'll take up to 16 invalidations before just flushing the whole TLB.
+ *
+ * A request names a range of pages by the ASID they have on the
+ * target cpu, generation included (see ASID_BITS in <vm.h>), rather
+ * than by address space, since shootdowns are asynchronous and the
+ * address space may be gone by the time the target gets to it.
  */
 
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	uint32_t ts_asid;
+	vaddr_t ts_vaddr;
+	unsigned ts_npages;
 };
 
 #define TLBSHOOTDOWN_MAX 16
@@ -37,6 +37,7 @@
 #include <current.h>
 #include <copyinout.h>
 #include <syscall.h>
+#include "opt-dumbvm.h"
 
 
 /*
@@ -261,6 +262,14 @@ syscall(struct trapframe *tf)
 		}
 		break;
 
+#if !OPT_DUMBVM
+	    /* VM calls */
+
+	    case SYS___meminfo:
+		err = sys___meminfo((userptr_t)tf->tf_a0);
+		break;
+#endif
+
 
 
 	    default:
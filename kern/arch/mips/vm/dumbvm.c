@@ -118,6 +118,19 @@ alloc_kpages(unsigned npages)
 	return PADDR_TO_KVADDR(pa);
 }
 
+vaddr_t
+alloc_kpages_flags(unsigned npages, int flags)
+{
+	if (flags & AKP_ZERO) {
+		vaddr_t va = alloc_kpages(npages);
+		if (va != 0) {
+			bzero((void *)va, npages * PAGE_SIZE);
+		}
+		return va;
+	}
+	return alloc_kpages(npages);
+}
+
 void
 free_kpages(vaddr_t addr)
 {
@@ -133,6 +146,12 @@ vm_tlbshootdown(const struct tlbshootdown *ts)
 	panic("dumbvm tried to do tlb shootdown?!\n");
 }
 
+void
+vm_tlbshootdown_all(void)
+{
+	panic("dumbvm tried to do tlb shootdown?!\n");
+}
+
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
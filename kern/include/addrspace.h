@@ -36,6 +36,8 @@
 
 
 #include <vm.h>
+#include <bitmap.h>
+#include <spinlock.h>
 #include "opt-dumbvm.h"
 
 struct vnode;
@@ -51,6 +53,10 @@ struct region {
     int is_writeable;
     int is_executable;
     bool prepare_load_recover_flag;
+    // one bit per page that has a frame and an HPT entry, so copy and
+    // destroy only visit resident pages instead of probing all npages
+    struct bitmap* resident;
+    size_t nresident;
     struct region* next_region;
 };
 
@@ -59,7 +65,13 @@ struct region* create_region(vaddr_t vbase, size_t npages,
 void add_region_to_as(struct addrspace* as, struct region* _region);
 void destroy_all_region(struct addrspace* as, struct region* _region);
 struct region* vaddr_region_mapping(struct addrspace* as, vaddr_t fault_addr);
-struct region* copy_region(struct addrspace* newas, struct region* old_region);
+struct region* copy_region(struct addrspace* oldas, struct addrspace* newas, struct region* old_region);
+void region_mark_resident(struct addrspace* as, struct region* _region, vaddr_t vpn);
+void region_clear_dirty(struct addrspace* as, struct region* _region);
+// as_copy shares the resident pages copy-on-write (the default) or, if
+// off, copies them all; off only to measure the difference. OPT_IPT
+// always copies.
+void as_set_cow(bool on);
 /*
  * Address space - data structure associated with the virtual memory
  * space of a process.
@@ -78,7 +90,22 @@ struct addrspace {
         paddr_t as_stackpbase;
 #else
         /* Put stuff here for your VM system */
+        // names this address space in hash page table entries
+        uint32_t hpt_id;
+        // generation and ASID on each cpu, indexed by c_number
+        uint32_t asid[VM_MAXCPUS];
+        // cpus that ever gave it an ASID, the only ones that can have
+        // its translations in their TLB; bits are only ever set
+        volatile uint32_t cpumask;
+        struct spinlock cpumask_lock;
         int num_regions;
+        // resident pages over all regions, the process's RSS
+        unsigned rss;
+        // where its code (executable, read-only regions) and its stack
+        // are, for the wired TLB slots; 0 if not defined
+        vaddr_t text_base;
+        vaddr_t text_end;
+        vaddr_t stack_base;
         // use linked_list to organize the regions
         struct region* first_region;
 #endif
@@ -41,6 +41,8 @@
  *     bitmap_mark    - set a clear bit by its index.
  *     bitmap_unmark  - clear a set bit by its index.
  *     bitmap_isset   - return whether a particular bit is set or not.
+ *     bitmap_nextset - find the first set bit at or after START, skipping
+ *                      over empty words. Returns ENOENT if there is none.
  *     bitmap_destroy - destroy bitmap.
  */
 
@@ -53,6 +55,8 @@ int            bitmap_alloc(struct bitmap *, unsigned *index);
 void           bitmap_mark(struct bitmap *, unsigned index);
 void           bitmap_unmark(struct bitmap *, unsigned index);
 int            bitmap_isset(struct bitmap *, unsigned index);
+int            bitmap_nextset(struct bitmap *, unsigned start,
+                              unsigned *index);
 void           bitmap_destroy(struct bitmap *);
 
 
@@ -34,6 +34,7 @@
 #include <spinlock.h>
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
+#include <vmstat.h>
 
 
 /*
@@ -61,6 +62,10 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	uint32_t c_asid_gen;		/* Current ASID generation */
+	uint32_t c_asid_next;		/* Next ASID to hand out */
+	uint32_t c_asid;		/* ASID loaded in EntryHi */
+	struct vmstats c_vmstats;	/* VM event counters */
 
 	/*
 	 * Accessed by other cpus.
@@ -82,10 +87,18 @@ struct cpu {
 	 * The contents of struct tlbshootdown are also machine-
 	 * dependent and might reasonably be either an address space
 	 * and vaddr pair, or a paddr, or something else.
+	 *
+	 * A request that finds the queue full sets c_shootdown_full
+	 * instead, and the whole TLB is flushed. c_shootdown_posted
+	 * counts requests made, and c_shootdown_done is set to it once
+	 * they have all been handled, so a sender can wait for its own.
 	 */
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	unsigned c_numshootdown;
+	bool c_shootdown_full;
+	unsigned c_shootdown_posted;
+	volatile unsigned c_shootdown_done;
 	struct spinlock c_ipi_lock;
 
 	/*
@@ -112,6 +125,13 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * Number of cpus, and the cpu with a given c_number, for code that
+ * walks all of them (e.g. to total per-cpu counters).
+ */
+unsigned cpu_count(void);
+struct cpu *cpu_bynumber(unsigned number);
+
 /*
  * Produce a string describing the CPU type.
  */
@@ -154,7 +174,9 @@ void cpu_halt(void);
  *
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
- * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data. It
+ * returns a ticket: the request has been handled once the target's
+ * c_shootdown_done has reached it.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -168,7 +190,7 @@ void cpu_halt(void);
 
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
-void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
 
 void interprocessor_interrupt(void);
 
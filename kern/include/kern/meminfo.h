@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_MEMINFO_H_
+#define _KERN_MEMINFO_H_
+
+/*
+ * Physical memory use, returned by __meminfo(). All counts are in
+ * pages of mi_pagesize bytes. The owner classes, mi_free and
+ * mi_kernel add up to mi_total; mi_zeroed is part of mi_free.
+ */
+struct meminfo {
+	__u32 mi_pagesize;
+	__u32 mi_total;		/* pages of RAM */
+	__u32 mi_kernel;	/* kernel image and boot-time tables */
+	__u32 mi_kheap;		/* kernel heap (kmalloc) */
+	__u32 mi_user;		/* anonymous user memory */
+	__u32 mi_pgtable;	/* page table entries */
+	__u32 mi_filecache;	/* file cache */
+	__u32 mi_free;		/* free, including mi_zeroed */
+	__u32 mi_zeroed;	/* free and already zeroed */
+	__u32 mi_rss;		/* resident pages of the calling process */
+};
+
+#endif /* _KERN_MEMINFO_H_ */
@@ -98,6 +98,29 @@ int kmalloctest3(int, char **);
 int kmalloctest4(int, char **);
 int nettest(int, char **);
 
+/* VM system tests */
+int hptloadbench(int, char **);
+int hptstress(int, char **);
+int hptrefillbench(int, char **);
+int hptbatchbench(int, char **);
+int hptresizetest(int, char **);
+int asidbench(int, char **);
+int ftfreebench(int, char **);
+int buddytest(int, char **);
+int magazinebench(int, char **);
+int zerobench(int, char **);
+int rmaptest(int, char **);
+int meminfotest(int, char **);
+int wmarktest(int, char **);
+int fastpathbench(int, char **);
+int stlbtest(int, char **);
+int tlbinvaltest(int, char **);
+int shootstress(int, char **);
+int tlbpolicytest(int, char **);
+int prefetchtest(int, char **);
+int cowtest(int, char **);
+int bootfreetest(int, char **);
+
 /* Routine for running a user-level program. */
 int runprogram(char *progname);
 
@@ -35,36 +35,213 @@
  *
  * You'll probably want to add stuff here.
  */
-#include <synch.h>
+#include <spinlock.h>
+#include "opt-ipt.h"
+#include "opt-vmdebug.h"
 
+struct addrspace;
+
+// One translation, packed into 12 bytes and linked by index:
+//   tag   virtual page in the top 20 bits, the address space's HPT id
+//         (see hpt_as_register) in the low 12; 0 in a free entry
+//   PFN   frame with the TLBLO cache/dirty/valid bits
+//   next  index of the next entry of the chain, HPT_NIL at the end
+// Use HPT_ENTRY_VPN and hpt_entry_as to take the tag apart.
 struct hpt_entry {
-	struct addrspace * Pid;
-	vaddr_t VPN;
+	uint32_t tag;
 	paddr_t PFN; // PUT caching/dirty/valid bit in PFN as well
-	struct hpt_entry * next_entry;
+	uint32_t next;
 };
 
+#define HPT_NIL 0xffffffff
+
+// Address spaces are known to the table by a small id instead of a
+// pointer. Id 0 is never handed out, so a zero tag is a free entry.
+#define HPT_ID_BITS 12
+#define HPT_ID_MASK ((1 << HPT_ID_BITS) - 1)
+#define HPT_MAX_AS  (1 << HPT_ID_BITS)
+
+#define HPT_TAG(id, VPN)     (((VPN) & ~HPT_ID_MASK) | (id))
+#define HPT_ENTRY_VPN(entry) ((entry)->tag & ~HPT_ID_MASK)
+
+// entry pool, HPT_ENTRIES_PER_FRAME entries per frame; unused entries
+// are kept on a free list threaded through next, so insert never has
+// to scan for a slot. With OPT_IPT there is no pool (NULL): the entry
+// for a frame lives in that frame's frame_table_entry, and the buckets
+// are the hash anchor table indexing into the frame table.
 struct hpt_entry * hash_page_table;
 
-// static struct spinlock hpt_lock = SPINLOCK_INITIALIZER;
-struct lock * hpt_lock;
+// Most frames have one translation, but as_copy shares a process's
+// frames with the child copy-on-write until either side writes, so
+// there is room for every frame to be mapped twice.
+#define HPT_ENTRIES_PER_FRAME 2
+
+// Writers lock the table in stripes. A key's stripe is the top
+// HPT_STRIPE_BITS bits of its hash, which is also a contiguous range
+// of buckets in a table of any size, so the same lock covers a key
+// before and after the table is resized. hpt_lookup takes no lock at
+// all, it validates against a per-stripe sequence counter.
+#define HPT_STRIPE_BITS  4
+#define HPT_LOCK_STRIPES (1 << HPT_STRIPE_BITS)
 
 // We suggest sizing the table to have twice as many entries 
 // as there are frames of physical memory in RAM.
 #define HPT_SIZE_TIMES_LARGE 2
+// number of buckets, a power of two so a bucket is just the top bits
+// of the hash. It changes with the load, see hpt_rehash_step.
 int hpt_size;
 
+// The bucket array grows (doubles) when there are more than
+// HPT_GROW_LOAD entries per 100 buckets and shrinks (halves) below
+// HPT_SHRINK_LOAD, between 2^HPT_MIN_ORDER and 2^HPT_MAX_ORDER buckets.
+#define HPT_MIN_ORDER    8
+#define HPT_MAX_ORDER    16
+#define HPT_GROW_LOAD    100
+#define HPT_SHRINK_LOAD  25
+// buckets moved to the new array per hpt_rehash_step call
+#define HPT_REHASH_STEP  4
+
+// Buckets are allocated in chunks of 2^HPT_CHUNK_ORDER, 1k each, so a
+// chunk is a kmalloc block: cache-line aligned and never more than a
+// page.
+#define HPT_CHUNK_ORDER  8
+#define HPT_CHUNK_SIZE   (1 << HPT_CHUNK_ORDER)
+#define HPT_MAX_CHUNKS   (1 << (HPT_MAX_ORDER - HPT_CHUNK_ORDER))
+
+// Hash used by hpt_hash, pick one at compile time.
+//   HPT_HASH_XOR        the original (as ^ VPN), masked to the table size,
+//                       with the HPT id standing in for the as pointer
+//                       (bit reversed, so the low bits pick the bucket)
+//   HPT_HASH_FIBONACCI  multiplicative (Fibonacci) hashing of the page
+//                       number mixed with the address space id
+#define HPT_HASH_XOR       0
+#define HPT_HASH_FIBONACCI 1
+#define HPT_HASH HPT_HASH_FIBONACCI
+
 void hpt_init(void);
 
+// Give AS an HPT id (as->hpt_id) for its entries, from as_create.
+// Returns ENOMEM if HPT_MAX_AS - 1 address spaces already exist.
+int hpt_as_register(struct addrspace * as);
+// Give the id back, from as_destroy once all its entries are gone.
+void hpt_as_unregister(struct addrspace * as);
+// the address space an entry belongs to
+struct addrspace * hpt_entry_as(struct hpt_entry * entry);
+
 struct hpt_entry * hpt_lookup(struct addrspace * as, vaddr_t faultaddress);
+struct hpt_entry * hpt_lookup_locked(struct addrspace * as, vaddr_t faultaddress);
 
 struct hpt_entry * hpt_insert(struct addrspace * as, vaddr_t VPN, paddr_t PFN, int cache_bit, int dirty_bit, int valid_bit);
 
 int hpt_delete(struct addrspace * as, vaddr_t VPN);
+// make a translation read-only or writeable; ENOENT if there is none
+int hpt_clear_dirty(struct addrspace * as, vaddr_t VPN);
+int hpt_set_dirty(struct addrspace * as, vaddr_t VPN);
+// switch a translation to frame PFN, *old gets the frame it had; a
+// non-zero *old is the frame it must have, EAGAIN if it doesn't
+int hpt_remap(struct addrspace * as, vaddr_t VPN, paddr_t PFN, int dirty_bit, paddr_t * old);
+
+// vm_fault refills resident pages from the HPT before looking at the
+// regions; off only to measure the difference
+void vm_set_fastpath(bool on);
 
+// One page for the batch calls below. The caller fills in VPN, and PFN
+// (the frame, without flag bits) for insert. The batch calls group the
+// items by lock stripe and take each stripe lock once per batch, so
+// fork and exit don't pay one lock round trip per page.
+struct hpt_batch_item {
+	vaddr_t VPN;
+	paddr_t PFN;
+	struct hpt_entry * entry;
+	uint32_t hash;      // filled in by the batch call
+};
+
+// a batch that fits in one page, what fork/exit use per kmalloc
+#define HPT_BATCH_MAX (PAGE_SIZE / sizeof(struct hpt_batch_item))
+
+// Insert all N items of one address space with the same flag bits.
+// entry is set to the new entry, or NULL for items that could not be
+// inserted. Returns how many were inserted.
+int hpt_insert_batch(struct addrspace * as, struct hpt_batch_item * items, unsigned n, int cache_bit, int dirty_bit, int valid_bit);
+// Delete all N items of one address space. PFN is set to what the
+// entry held (flag bits included), or 0 if there was no entry.
+// Returns how many were deleted.
+int hpt_delete_batch(struct addrspace * as, struct hpt_batch_item * items, unsigned n);
+
+// number of entries currently in use, for stats and benchmarks
+int hpt_entry_count(void);
+// print occupancy and the chain-length histogram (hptstats menu command)
+void hpt_printstats(void);
+// print size, load and rehash progress (hptsize menu command)
+void hpt_printsize(void);
+
+// Start a resize if the load is out of bounds, or move the next few
+// buckets of one that is going on. Called after faults, fork and exit,
+// so the cost of a rehash is spread over them.
+void hpt_rehash_step(void);
+
+// address space registered under an HPT id, NULL if none
+struct addrspace * hpt_id_as(uint32_t id);
+// print the resident size of every live address space (meminfo menu
+// command)
+void hpt_print_rss(void);
+
+// 32-bit hash of (as, VPN); the bucket is its top bits
 uint32_t hpt_hash(struct addrspace *as, vaddr_t faultaddr);
 
+// Load a translation into the TLB, tagged with the ASID of the address
+// space this cpu has active (see as_activate), in a slot picked as
+// below.
 void write_to_tlb(struct hpt_entry * entry);
+
+// TLB replacement for refills, switchable at run time:
+//   TLB_POLICY_RANDOM  tlb_random, the processor picks a slot
+//   TLB_POLICY_RR      round robin over the slots tlb_random uses
+//   TLB_POLICY_CLOCK   clock over those slots, with a per-cpu shadow of
+//                      reference bits; passing a referenced slot clears
+//                      its entry's valid bit, and the fault on the next
+//                      use sets the reference bit again
+// tlb_random never picks the first TLB_WIRED slots. With
+// vm_set_tlb_wired on (the default), refills of the running program's
+// code and stack pages go in those, half each in turn, so a loop over
+// more data than the TLB holds can't push them out.
+#define TLB_POLICY_RANDOM 0
+#define TLB_POLICY_RR     1
+#define TLB_POLICY_CLOCK  2
+#define TLB_NPOLICIES     3
+#define TLB_WIRED         8
+void vm_set_tlb_policy(int policy);
+void vm_set_tlb_wired(bool on);
+// TLB prefetch: a fast-path refill may also load the translations of
+// the resident pages right after the faulting one. The number grows
+// while faults come in sequence (each just past the pages preloaded
+// with the last) and shrinks otherwise, up to the limit set by
+// vm_set_tlb_prefetch, TLB_PREFETCH_MAX by default; 0 turns it off.
+#define TLB_PREFETCH_MAX  8
+void vm_set_tlb_prefetch(unsigned max);
+// Invalidate every slot of this cpu's TLB. Call at splhigh.
+void vm_tlb_flush(void);
+// Invalidate this cpu's TLB entries for NPAGES pages of AS starting at
+// VPN, leaving everything else in place. Other cpus are not touched.
+void vm_tlb_invalidate(struct addrspace * as, vaddr_t VPN, unsigned npages);
+// whether this cpu's TLB holds a translation for VPN of AS, for tests
+bool vm_tlb_probe(struct addrspace * as, vaddr_t VPN);
+// vm_tlb_invalidate on every cpu that may hold the pages (as->cpumask):
+// this one directly, the others by a shootdown IPI. With WAIT, returns
+// once the other cpus have handled it; call at spl0 without spinlocks.
+void vm_tlb_shootdown(struct addrspace * as, vaddr_t VPN, unsigned npages, bool wait);
+
+// Software TLB: each cpu keeps the last translations vm_fault refilled
+// in a direct-mapped table of STLB_SIZE slots, keyed by ASID and VPN,
+// and looks there before hpt_lookup. Slots hold the address space's
+// full per-cpu ASID, generation included, which is never handed out
+// again, so ASID rollover and as_destroy leave nothing reachable;
+// hpt_delete, hpt_delete_batch and hpt_clear_dirty drop the page from
+// every cpu's table. vm_set_stlb turns it off, to measure the
+// difference.
+#define STLB_ORDER 11
+#define STLB_SIZE  (1 << STLB_ORDER)
+void vm_set_stlb(bool on);
 // used when doing hpt_insert defaultly
 #define DEFAULT_CACHE_BIT 0
 #define DEFAULT_DIRTY_BIT 1
@@ -79,19 +256,197 @@ void write_to_tlb(struct hpt_entry * entry);
 #define VM_FAULT_READONLY    2    /* A write to a readonly page was attempted*/
 
 
+// Hardware address space ids. Each cpu hands out ASIDs 1..NUM_ASIDS-1
+// on its own; running out starts a new generation, which flushes that
+// cpu's TLB and makes every address space take a fresh ASID the next
+// time it is activated there. An address space remembers its ASID per
+// cpu as (generation << ASID_BITS) | asid, 0 meaning none yet.
+#define ASID_BITS    6
+#define NUM_ASIDS    (1 << ASID_BITS)
+#define ASID_MASK    (NUM_ASIDS - 1)
+// size of per-cpu arrays in the VM system (struct addrspace's ASIDs,
+// the frame magazines); sys161 has at most 32 cpus
+#define VM_MAXCPUS   32
+
 /* Initialization function */
 void vm_bootstrap(void);
 
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
+/* Frame table, see frametable.c */
+
+// Frames are handed out by a binary buddy allocator. A request for
+// npages frames gets a block of 2^order frames, the smallest such block
+// that fits, aligned to its own size so a block's buddy is found by
+// flipping bit `order` of its frame number. A freed block is merged
+// with its buddy for as long as the buddy is free and whole, so free
+// memory stays in large blocks. FT_MAX_ORDER is the largest block.
+#define FT_MAX_ORDER 10
+#define FT_NO_ORDER  0xff
+
+// Each cpu keeps a magazine of up to FT_MAGAZINE_SIZE free single
+// frames, so most one-page allocations and frees never take
+// frame_table_lock. An empty magazine is refilled, and a full one
+// drained, FT_MAGAZINE_BATCH frames at a time under one lock hold.
+// frame_table_set_magazine changes the size in use at run time (0
+// turns the magazines off); it can't exceed FT_MAGAZINE_SIZE.
+#define FT_MAGAZINE_SIZE  32
+#define FT_MAGAZINE_BATCH 16
+
+// A kernel thread keeps up to FT_ZERO_TARGET single frames zeroed
+// ahead of time, and starts again once the pool is down to
+// FT_ZERO_LOW, so page faults rarely pay for a bzero. 0 turns it off.
+#define FT_ZERO_TARGET 64
+#define FT_ZERO_LOW    32
+
+// Watermarks on free frames, counting the buddy lists and the zeroed
+// pool (frame_table_avail). Going below FT_WMARK_LOW wakes the reclaim
+// thread, and the zeroer takes no frames while below FT_WMARK_HIGH.
+// The last FT_WMARK_MIN frames are a reserve for the kernel: a user
+// allocation below it waits for up to FT_THROTTLE_TRIES reclaim passes
+// and then fails.
+#define FT_WMARK_MIN      16
+#define FT_WMARK_LOW      32
+#define FT_WMARK_HIGH     64
+#define FT_THROTTLE_TRIES 4
+
+// Allocations made before the frame table exists come from
+// ram_stealmem. Up to FT_BOOT_ALLOCS of them are recorded, so that
+// frame_table_reclaim_boot can hand the stolen frames that were freed
+// meanwhile to the frame table, and later frees of the others go there
+// too. With more than that, nothing is reclaimed.
+#define FT_BOOT_ALLOCS 128
+
+// alloc_kpages_flags flags
+#define AKP_ZERO 0x1    // the caller needs the frames zeroed
+#define AKP_USER 0x2    // anonymous user memory, not kernel heap
+
+// Owner classes of allocated frames, for memory accounting. Frames
+// taken before the frame table existed are FT_OWNER_KERNEL, except for
+// those holding the page table entries, FT_OWNER_PGTABLE. Later
+// allocations are FT_OWNER_KHEAP, or FT_OWNER_USER with AKP_USER.
+// Nothing caches file data in frames yet, so FT_OWNER_FILE stays 0.
+#define FT_OWNER_KERNEL  0
+#define FT_OWNER_KHEAP   1
+#define FT_OWNER_USER    2
+#define FT_OWNER_PGTABLE 3
+#define FT_OWNER_FILE    4
+#define FT_NOWNERS       5
+
+// Reverse map entry: one user mapping of a frame, as the HPT tag of the
+// translation (VPN and the address space's HPT id, see HPT_TAG). The
+// first mapping of a frame is kept in its frame_table_entry; further
+// ones, for a shared frame, are chained off it.
+struct frame_rmap {
+        uint32_t tag;
+        struct frame_rmap * next;
+};
+
+struct frame_table_entry {
+#if OPT_IPT
+        // inverted page table entry for this frame; PFN always refers
+        // back to the frame itself
+        struct hpt_entry ipt_entry;
+#endif
+        // links in the free list of the block's order, only used in
+        // the first frame of a free block
+        struct frame_table_entry * next_free;
+        struct frame_table_entry * prev_free;
+        // set in every frame of an allocated block
+        bool in_use_flag;
+        // in the first frame of a block, free or allocated, the block's
+        // order; FT_NO_ORDER in every other frame
+        uint8_t order;
+        // owner class (FT_OWNER_*) of an allocated block, first frame only
+        uint8_t owner;
+        // references to an allocated frame: 1 from allocation, plus one
+        // per frame_ref; 0 while free
+        uint16_t refcount;
+        // first user mapping of the frame (HPT tag), 0 if unmapped
+        uint32_t rmap;
+        // the other mappings of a shared frame
+        struct frame_rmap * rmap_more;
+};
+
+struct frame_table {
+        struct frame_table_entry * frame_table_arr;
+        // free blocks of 2^k frames, k = 0..FT_MAX_ORDER
+        struct frame_table_entry * free_lists[FT_MAX_ORDER + 1];
+        // number of free frames, in blocks of all orders
+        int free_frames;
+        // before is the frames allocated to kernel and frame table itself
+        int free_ram_frame_start_index;
+        // total frame/physical page there will be
+        int page_number;
+};
+
+extern struct frame_table * ft_table;
+
+// bytes used by the page table and the frame table, printed at boot;
+// with OPT_IPT the entries are counted in the frame table
+size_t hpt_footprint(void);
+size_t frame_table_footprint(void);
+// Reference counts. frame_unref drops a reference and frees the frame
+// when it was the last one; returns true if it did.
+void frame_ref(paddr_t paddr);
+bool frame_unref(paddr_t paddr);
+unsigned frame_refcount(paddr_t paddr);
+
+// Reverse map of user frames: vm_fault, fork and exit record and drop
+// the (address space, VPN) mappings of every frame they map. Adding
+// can fail with ENOMEM when a shared frame needs a chain entry.
+int frame_rmap_add(paddr_t paddr, struct addrspace * as, vaddr_t VPN);
+void frame_rmap_remove(paddr_t paddr, struct addrspace * as, vaddr_t VPN);
+unsigned frame_rmap_count(paddr_t paddr);
+
+#if OPT_VMDEBUG
+// Consistency checks (options vmdebug). frame_table_check goes over
+// the free lists, counts, refcounts and reverse maps of every frame;
+// frame_table_check_as checks that each resident page of AS is mapped
+// to an in-use frame whose reverse map names it. Both panic on error.
+void frame_table_check(void);
+void frame_table_check_as(struct addrspace * as);
+#endif
+
+// print free frames and free blocks per order (ftstats menu command)
+void frame_table_printstats(void);
+// number of free frames, magazines included
+int frame_table_free_count(void);
+// free frames the watermarks are checked against, magazines excluded
+int frame_table_avail(void);
+// Frames per owner class, free and pre-zeroed frames, for the meminfo
+// menu command and the __meminfo system call. mi_rss is left alone.
+struct meminfo;
+void frame_table_meminfo(struct meminfo * mi);
+// set how many frames each cpu's magazine may hold, 0 to bypass them
+void frame_table_set_magazine(unsigned size);
+
 /* Allocate/free kernel heap pages (called by kmalloc/kfree) */
 void frame_table_init(void);
+// start the zeroing thread, once threads can be forked
+void frame_table_start_zeroer(void);
+// start the reclaim thread, see FT_WMARK_LOW
+void frame_table_start_reclaim(void);
+// give the boot frames no longer in use to the frame table, at the end
+// of vm_bootstrap
+void frame_table_reclaim_boot(void);
+// how many frames that was, and the frame number the boot frames end
+// at, for tests
+void frame_table_boot_info(unsigned * nreclaimed, int * boot_end);
+// let allocations use the pre-zeroed pool or not (for benchmarks), and
+// how many frames are in it
+void frame_table_set_zero_pool(bool on);
+unsigned frame_table_zeroed_count(void);
+// alloc_kpages zeroes the frames, alloc_kpages_flags only with AKP_ZERO
 vaddr_t alloc_kpages(unsigned npages);
+vaddr_t alloc_kpages_flags(unsigned npages, int flags);
 void free_kpages(vaddr_t addr);
 
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
+/* ...when requests were coalesced, flush everything */
+void vm_tlbshootdown_all(void);
 
 
 #endif /* _VM_H_ */
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * VM event counters.
+ *
+ * Each cpu counts its own events in curcpu->c_vmstats without taking
+ * any lock; readers add them up with vmstats_total, which is only
+ * approximate while other cpus are running.
+ */
+
+#ifndef _VMSTAT_H_
+#define _VMSTAT_H_
+
+
+struct vmstats {
+	unsigned vs_faults;		/* vm_fault calls (TLB misses) */
+	unsigned vs_refills;		/* ...filled from the page table */
+	unsigned vs_fastpath;		/* ...without looking at regions */
+	unsigned vs_newpages;		/* ...that needed a new page */
+	unsigned vs_activates;		/* as_activate with an address space */
+	unsigned vs_asid_allocs;	/* ASIDs handed out */
+	unsigned vs_asid_rollovers;	/* ASID generations started */
+	unsigned vs_tlb_flushes;	/* whole-TLB invalidations */
+	unsigned vs_tlb_invals;		/* single TLB entries dropped */
+	unsigned vs_shootdowns;		/* shootdown requests sent */
+	unsigned vs_shootdowns_recv;	/* ...and handled */
+	unsigned vs_shootdown_flushes;	/* full flushes for a full queue */
+	unsigned vs_tlb_wired;		/* refills into wired slots */
+	unsigned vs_tlb_rearms;		/* clock reference faults */
+	unsigned vs_tlb_prefetched;	/* neighbours preloaded on refills */
+	unsigned vs_prefetch_seq;	/* refills continuing a stream */
+	unsigned vs_cow_shared;		/* pages shared by as_copy */
+	unsigned vs_cow_copies;		/* ...copied on a write */
+	unsigned vs_cow_reuses;		/* ...written by the last holder */
+	unsigned vs_zero_pool;		/* zeroed frames from the pool */
+	unsigned vs_zero_sync;		/* ...zeroed while allocating */
+	unsigned vs_zero_skip;		/* frames that needed no zeroing */
+	unsigned vs_zero_idle;		/* frames zeroed by the zeroer */
+	unsigned vs_wmark_low;		/* reclaimer woken below low */
+	unsigned vs_reserve;		/* kernel allocations below min */
+	unsigned vs_throttle;		/* user allocations below min */
+	unsigned vs_throttle_fail;	/* ...that failed */
+	unsigned vs_reclaim_runs;	/* reclaim passes */
+	unsigned vs_reclaimed;		/* frames they gave back */
+	unsigned vs_stlb_hits;		/* software TLB hits */
+	unsigned vs_stlb_misses;	/* ...and misses */
+	unsigned vs_stlb_invals;	/* slots dropped by unmaps */
+};
+
+/* Count an event on the current cpu. Needs <current.h> and <cpu.h>. */
+#define VMSTAT_INC(field) (curcpu->c_vmstats.field++)
+#define VMSTAT_ADD(field, n) (curcpu->c_vmstats.field += (n))
+
+/* Sum of the counters of all cpus. */
+void vmstats_total(struct vmstats *total);
+
+/* Print the totals (vmstat menu command). */
+void vmstats_print(void);
+
+
+#endif /* _VMSTAT_H_ */
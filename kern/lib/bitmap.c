@@ -168,6 +168,34 @@ bitmap_isset(struct bitmap *b, unsigned index)
         return (b->v[ix] & mask);
 }
 
+int
+bitmap_nextset(struct bitmap *b, unsigned start, unsigned *index)
+{
+        unsigned ix;
+        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
+        unsigned offset;
+
+        offset = start % BITS_PER_WORD;
+        for (ix = start / BITS_PER_WORD; ix<maxix; ix++, offset = 0) {
+                if (b->v[ix] == 0) {
+                        continue;
+                }
+                for (; offset < BITS_PER_WORD; offset++) {
+                        WORD_TYPE mask = ((WORD_TYPE)1) << offset;
+
+                        if (b->v[ix] & mask) {
+                                *index = (ix*BITS_PER_WORD)+offset;
+                                if (*index >= b->nbits) {
+                                        /* leftover bits at the end */
+                                        return ENOENT;
+                                }
+                                return 0;
+                        }
+                }
+        }
+        return ENOENT;
+}
+
 void
 bitmap_destroy(struct bitmap *b)
 {
@@ -45,8 +45,13 @@
 #include <pid.h>
 #include <syscall.h>
 #include <test.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <vmstat.h>
+#include <kern/meminfo.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-dumbvm.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -500,6 +505,312 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+#if !OPT_DUMBVM
+static
+int
+cmd_hptstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	hpt_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_hptsize(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	hpt_printsize();
+
+	return 0;
+}
+
+static
+int
+cmd_ftstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	frame_table_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_vmstat(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vmstats_print();
+
+	return 0;
+}
+
+static
+int
+cmd_meminfo(int nargs, char **args)
+{
+	struct meminfo mi;
+
+	(void)nargs;
+	(void)args;
+
+	frame_table_meminfo(&mi);
+	kprintf("%u pages of %u bytes\n", mi.mi_total, mi.mi_pagesize);
+	kprintf("kernel:      %u\n", mi.mi_kernel);
+	kprintf("kernel heap: %u\n", mi.mi_kheap);
+	kprintf("user:        %u\n", mi.mi_user);
+	kprintf("page tables: %u (%uk in use now)\n", mi.mi_pgtable,
+		hpt_footprint() / 1024);
+	kprintf("file cache:  %u\n", mi.mi_filecache);
+	kprintf("free:        %u (%u zeroed)\n", mi.mi_free, mi.mi_zeroed);
+	hpt_print_rss();
+
+	return 0;
+}
+
+static const char *tlbpolicies[TLB_NPOLICIES] = {
+	"random", "rr", "clock",
+};
+
+/*
+ * Command for choosing the TLB replacement policy and whether code
+ * and stack pages use the wired slots.
+ */
+static
+int
+cmd_tlbpolicy(int nargs, char **args)
+{
+	int i;
+
+	if (nargs == 2 || nargs == 3) {
+		for (i=0; i<TLB_NPOLICIES; i++) {
+			if (!strcmp(args[1], tlbpolicies[i])) {
+				break;
+			}
+		}
+		if (i < TLB_NPOLICIES &&
+		    (nargs == 2 || !strcmp(args[2], "wired") ||
+		     !strcmp(args[2], "nowired"))) {
+			vm_set_tlb_policy(i);
+			vm_set_tlb_wired(nargs == 2 || !strcmp(args[2], "wired"));
+			return 0;
+		}
+	}
+	kprintf("Usage: tlbpolicy random|rr|clock [wired|nowired]\n");
+	return EINVAL;
+}
+
+/*
+ * Command for comparing the TLB replacement policies on a program: it
+ * is run once for each policy, without and with the wired slots, and
+ * the faults and refills of each run are printed. Leaves the default
+ * (random, wired) behind.
+ */
+static
+int
+cmd_tlbab(int nargs, char **args)
+{
+	struct vmstats before, after[TLB_NPOLICIES][2];
+	int policy, wired, result;
+
+	if (nargs < 2) {
+		kprintf("Usage: tlbab program [arguments]\n");
+		return EINVAL;
+	}
+
+	/* drop the leading "tlbab" */
+	args++;
+	nargs--;
+
+	for (policy=0; policy<TLB_NPOLICIES; policy++) {
+		for (wired=0; wired<2; wired++) {
+			vm_set_tlb_policy(policy);
+			vm_set_tlb_wired(wired);
+			vmstats_total(&before);
+			result = common_prog(nargs, args);
+			vmstats_total(&after[policy][wired]);
+			if (result) {
+				vm_set_tlb_policy(TLB_POLICY_RANDOM);
+				vm_set_tlb_wired(true);
+				return result;
+			}
+			after[policy][wired].vs_faults -= before.vs_faults;
+			after[policy][wired].vs_refills -= before.vs_refills;
+			after[policy][wired].vs_tlb_rearms -=
+				before.vs_tlb_rearms;
+		}
+	}
+	vm_set_tlb_policy(TLB_POLICY_RANDOM);
+	vm_set_tlb_wired(true);
+
+	kprintf("%s:\n", args[0]);
+	for (policy=0; policy<TLB_NPOLICIES; policy++) {
+		for (wired=0; wired<2; wired++) {
+			kprintf("  %-6s %-7s %8u faults %8u refills "
+				"%8u clock reference faults\n",
+				tlbpolicies[policy],
+				wired ? "wired" : "nowired",
+				after[policy][wired].vs_faults,
+				after[policy][wired].vs_refills,
+				after[policy][wired].vs_tlb_rearms);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Command for setting the TLB prefetch limit, 0 to turn it off.
+ */
+static
+int
+cmd_prefetch(int nargs, char **args)
+{
+	int max;
+
+	if (nargs == 2) {
+		max = atoi(args[1]);
+		if (max >= 0 && max <= TLB_PREFETCH_MAX) {
+			vm_set_tlb_prefetch(max);
+			return 0;
+		}
+	}
+	kprintf("Usage: prefetch 0..%d\n", TLB_PREFETCH_MAX);
+	return EINVAL;
+}
+
+/*
+ * Command for measuring TLB prefetch on a program: it is run once
+ * without prefetch and once with the default limit, and the faults,
+ * refills and preloaded translations of each run are printed. Leaves
+ * the default behind.
+ */
+static
+int
+cmd_prefetchab(int nargs, char **args)
+{
+	struct vmstats before, after[2];
+	int on, result;
+
+	if (nargs < 2) {
+		kprintf("Usage: prefetchab program [arguments]\n");
+		return EINVAL;
+	}
+
+	/* drop the leading "prefetchab" */
+	args++;
+	nargs--;
+
+	for (on=0; on<2; on++) {
+		vm_set_tlb_prefetch(on ? TLB_PREFETCH_MAX : 0);
+		vmstats_total(&before);
+		result = common_prog(nargs, args);
+		vmstats_total(&after[on]);
+		if (result) {
+			vm_set_tlb_prefetch(TLB_PREFETCH_MAX);
+			return result;
+		}
+		after[on].vs_faults -= before.vs_faults;
+		after[on].vs_refills -= before.vs_refills;
+		after[on].vs_tlb_prefetched -= before.vs_tlb_prefetched;
+	}
+	vm_set_tlb_prefetch(TLB_PREFETCH_MAX);
+
+	kprintf("%s:\n", args[0]);
+	for (on=0; on<2; on++) {
+		kprintf("  prefetch %-3s %8u faults %8u refills "
+			"%8u prefetched\n", on ? "on" : "off",
+			after[on].vs_faults, after[on].vs_refills,
+			after[on].vs_tlb_prefetched);
+	}
+	if (after[0].vs_refills > 0) {
+		kprintf("  %d%% fewer refills\n",
+			100 - (int)(after[1].vs_refills * 100 /
+				    after[0].vs_refills));
+	}
+
+	return 0;
+}
+
+/*
+ * Command for measuring copy-on-write fork on a program (bigfork,
+ * forktest): it is run once with as_copy copying every page and once
+ * sharing them, and the time, faults and copies of each run are
+ * printed. Leaves copy-on-write on.
+ */
+static
+int
+cmd_cowab(int nargs, char **args)
+{
+	struct vmstats before, after[2];
+	struct timespec start, end, took[2];
+	int cow, result;
+
+	if (nargs < 2) {
+		kprintf("Usage: cowab program [arguments]\n");
+		return EINVAL;
+	}
+
+	/* drop the leading "cowab" */
+	args++;
+	nargs--;
+
+	for (cow=0; cow<2; cow++) {
+		as_set_cow(cow);
+		vmstats_total(&before);
+		gettime(&start);
+		result = common_prog(nargs, args);
+		gettime(&end);
+		vmstats_total(&after[cow]);
+		if (result) {
+			as_set_cow(true);
+			return result;
+		}
+		timespec_sub(&end, &start, &took[cow]);
+		after[cow].vs_faults -= before.vs_faults;
+		after[cow].vs_newpages -= before.vs_newpages;
+		after[cow].vs_cow_copies -= before.vs_cow_copies;
+	}
+	as_set_cow(true);
+
+	kprintf("%s:\n", args[0]);
+	for (cow=0; cow<2; cow++) {
+		kprintf("  %-13s %llu.%09lu seconds %8u faults %8u new pages "
+			"%8u copied on write\n",
+			cow ? "copy-on-write" : "copy",
+			(unsigned long long)took[cow].tv_sec,
+			(unsigned long)took[cow].tv_nsec, after[cow].vs_faults,
+			after[cow].vs_newpages, after[cow].vs_cow_copies);
+	}
+
+	return 0;
+}
+
+#if OPT_VMDEBUG
+static
+int
+cmd_ftcheck(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	frame_table_check();
+	kprintf("Frame table ok\n");
+
+	return 0;
+}
+#endif
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -584,6 +895,29 @@ static const char *testmenu[] = {
 	"[fs4] FS write stress 2             ",
 	"[fs5] FS long stress                ",
 	"[fs6] FS create stress              ",
+#if !OPT_DUMBVM
+	"[vm1] HPT load benchmark            ",
+	"[vm2] HPT stress test               ",
+	"[vm3] TLB refill benchmark          ",
+	"[vm4] HPT batch benchmark           ",
+	"[vm5] HPT resize test               ",
+	"[vm6] Context switch benchmark      ",
+	"[vm7] Frame free benchmark          ",
+	"[vm8] Multi-page allocation test    ",
+	"[vm9] Frame allocation benchmark    ",
+	"[vm10] Zero-fill fault benchmark    ",
+	"[vm11] Refcount/reverse map test    ",
+	"[vm12] Memory accounting test       ",
+	"[vm13] Watermark test               ",
+	"[vm14] TLB refill fast path bench   ",
+	"[vm15] Software TLB test            ",
+	"[vm16] Selective TLB invalidation   ",
+	"[vm17] TLB shootdown stress test    ",
+	"[vm18] TLB replacement policy test  ",
+	"[vm19] TLB prefetch test            ",
+	"[vm20] Copy-on-write fork test      ",
+	"[vm21] Reclaimed boot frame test    ",
+#endif
 	NULL
 };
 
@@ -606,6 +940,21 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+#if !OPT_DUMBVM
+	"[hptstats] Hash page table stats    ",
+	"[hptsize] Hash page table size/load ",
+	"[ftstats] Frame table free blocks   ",
+	"[vmstat] VM event counters          ",
+	"[meminfo] Memory use by owner       ",
+	"[tlbpolicy] TLB replacement policy  ",
+	"[tlbab] TLB policies on a program   ",
+	"[prefetch] TLB prefetch limit       ",
+	"[prefetchab] Prefetch on a program  ",
+	"[cowab] Fork copy-on-write A/B      ",
+#if OPT_VMDEBUG
+	"[ftcheck] Check frame table         ",
+#endif
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -657,6 +1006,21 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+#if !OPT_DUMBVM
+	{ "hptstats",   cmd_hptstats },
+	{ "hptsize",    cmd_hptsize },
+	{ "ftstats",    cmd_ftstats },
+	{ "vmstat",     cmd_vmstat },
+	{ "meminfo",    cmd_meminfo },
+	{ "tlbpolicy",  cmd_tlbpolicy },
+	{ "tlbab",      cmd_tlbab },
+	{ "prefetch",   cmd_prefetch },
+	{ "prefetchab", cmd_prefetchab },
+	{ "cowab",      cmd_cowab },
+#if OPT_VMDEBUG
+	{ "ftcheck",    cmd_ftcheck },
+#endif
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -669,6 +1033,29 @@ static struct {
 	{ "km4",	kmalloctest4 },
 #if OPT_NET
 	{ "net",	nettest },
+#endif
+#if !OPT_DUMBVM
+	{ "vm1",	hptloadbench },
+	{ "vm2",	hptstress },
+	{ "vm3",	hptrefillbench },
+	{ "vm4",	hptbatchbench },
+	{ "vm5",	hptresizetest },
+	{ "vm6",	asidbench },
+	{ "vm7",	ftfreebench },
+	{ "vm8",	buddytest },
+	{ "vm9",	magazinebench },
+	{ "vm10",	zerobench },
+	{ "vm11",	rmaptest },
+	{ "vm12",	meminfotest },
+	{ "vm13",	wmarktest },
+	{ "vm14",	fastpathbench },
+	{ "vm15",	stlbtest },
+	{ "vm16",	tlbinvaltest },
+	{ "vm17",	shootstress },
+	{ "vm18",	tlbpolicytest },
+	{ "vm19",	prefetchtest },
+	{ "vm20",	cowtest },
+	{ "vm21",	bootfreetest },
 #endif
 	{ "tt1",	threadtest },
 	{ "tt2",	threadtest2 },
@@ -72,6 +72,19 @@ bitmaptest(int nargs, char **args)
 		}
 	}
 
+	i = 0;
+	while (bitmap_nextset(b, i, &x)==0) {
+		KASSERT(x < TESTSIZE);
+		for (; i<(int)x; i++) {
+			KASSERT(data[i]==0);
+		}
+		KASSERT(data[x]);
+		i = x + 1;
+	}
+	for (; i<TESTSIZE; i++) {
+		KASSERT(data[i]==0);
+	}
+
 	for (i=0; i<TESTSIZE; i++) {
 		if (data[i]) {
 			bitmap_unmark(b, i);
@@ -0,0 +1,2664 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Test and benchmark code for the VM system (hash page table and
+ * frame table).
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <thread.h>
+#include <synch.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <machine/tlb.h>
+#include <vmstat.h>
+#include <kern/meminfo.h>
+#include <test.h>
+#include "opt-ipt.h"
+
+/*
+ * Fake translations used by the benchmarks are keyed by a scratch
+ * address space that never runs, and point at frames that are never
+ * touched through them (see fake_pfn). They are never written to the
+ * TLB.
+ */
+#define FAKE_VBASE   0x00400000
+#define FAKE_PFN(i)  ((((paddr_t)(i) % 0x7ffff) + 1) << 12)
+
+#if OPT_IPT
+/*
+ * In the inverted page table a translation lives in the entry of its
+ * frame, so fake translations need real frames that nothing else will
+ * map. They are allocated up front and kept in a two-level table so no
+ * single kmalloc is bigger than a page.
+ */
+#define FRAMESPERBLOCK  (PAGE_SIZE / sizeof(paddr_t))
+#define MAXFRAMEBLOCKS  64
+
+static paddr_t *fake_frames[MAXFRAMEBLOCKS];
+static unsigned fake_nframes;
+
+/* Make sure fake_pfn works for 0..n-1; returns how many it can do. */
+static
+unsigned
+fake_frames_reserve(unsigned n)
+{
+	unsigned block;
+	vaddr_t va;
+
+	while (fake_nframes < n) {
+		block = fake_nframes / FRAMESPERBLOCK;
+		if (block >= MAXFRAMEBLOCKS) {
+			break;
+		}
+		if (fake_frames[block] == NULL) {
+			fake_frames[block] = kmalloc(PAGE_SIZE);
+			if (fake_frames[block] == NULL) {
+				break;
+			}
+		}
+		va = alloc_kpages(1);
+		if (va == 0) {
+			break;
+		}
+		fake_frames[block][fake_nframes % FRAMESPERBLOCK] =
+			KVADDR_TO_PADDR(va);
+		fake_nframes++;
+	}
+	return fake_nframes;
+}
+
+static
+void
+fake_frames_release(void)
+{
+	unsigned i;
+
+	for (i=0; i<fake_nframes; i++) {
+		free_kpages(PADDR_TO_KVADDR(
+			fake_frames[i / FRAMESPERBLOCK][i % FRAMESPERBLOCK]));
+	}
+	for (i=0; i<MAXFRAMEBLOCKS; i++) {
+		if (fake_frames[i] != NULL) {
+			kfree(fake_frames[i]);
+			fake_frames[i] = NULL;
+		}
+	}
+	fake_nframes = 0;
+}
+
+static
+paddr_t
+fake_pfn(unsigned i)
+{
+	KASSERT(i < fake_nframes);
+	return fake_frames[i / FRAMESPERBLOCK][i % FRAMESPERBLOCK];
+}
+#else
+/* The hashed table doesn't care whether the frames exist. */
+static
+unsigned
+fake_frames_reserve(unsigned n)
+{
+	return n;
+}
+
+static
+void
+fake_frames_release(void)
+{
+}
+
+static
+paddr_t
+fake_pfn(unsigned i)
+{
+	return FAKE_PFN(i);
+}
+#endif
+
+static
+unsigned
+elapsed_us(const struct timespec *before, const struct timespec *after)
+{
+	struct timespec diff;
+
+	timespec_sub(after, before, &diff);
+	return diff.tv_sec * 1000000U + diff.tv_nsec / 1000;
+}
+
+////////////////////////////////////////////////////////////
+// vm1
+
+/*
+ * HPT fault-path latency at different table loads.
+ *
+ * The table is filled with fake entries until the load factor (entries
+ * per bucket) reaches the requested fraction, then nfaults simulated
+ * faults are timed. A simulated fault is what vm_fault does to the HPT
+ * for a new page: a missing lookup, an insert, and the lookup that
+ * hits on the next refill. The timed entries are deleted again so the
+ * load stays put. Nothing here calls hpt_rehash_step, so the table
+ * keeps the size it had at the start; nfaults is a tenth of that so
+ * the timed faults don't move the load much.
+ */
+
+#define NFAULTS 500
+
+static
+int
+hptfill(struct addrspace *as, int *filled, int target, int nframes,
+	int nfaults)
+{
+	while (hpt_entry_count() < target) {
+		if (*filled >= nframes - nfaults) {
+			return ENOMEM;
+		}
+		if (hpt_insert(as, FAKE_VBASE + *filled * PAGE_SIZE,
+			       fake_pfn(*filled), DEFAULT_CACHE_BIT,
+			       DEFAULT_DIRTY_BIT, DEFAULT_VALID_BIT) == NULL) {
+			return ENOMEM;
+		}
+		(*filled)++;
+	}
+	return 0;
+}
+
+int
+hptloadbench(int nargs, char **args)
+{
+	static const int loads[] = { 10, 50, 90 };
+	struct addrspace *fillas, *faultas;
+	struct timespec before, after;
+	vaddr_t vpn;
+	int filled, nframes, nfaults, i, j, result;
+
+	(void)nargs;
+	(void)args;
+
+	fillas = as_create();
+	faultas = as_create();
+	if (fillas == NULL || faultas == NULL) {
+		kprintf("vm1: as_create failed\n");
+		return ENOMEM;
+	}
+
+	kprintf("Starting HPT load benchmark (%d buckets)...\n", hpt_size);
+
+	nfaults = hpt_size / 10;
+	if (nfaults > NFAULTS) {
+		nfaults = NFAULTS;
+	}
+	nframes = fake_frames_reserve(hpt_size / 100 * 90 + nfaults);
+	filled = 0;
+	result = 0;
+	for (i=0; i<(int)(sizeof(loads)/sizeof(loads[0])); i++) {
+		result = hptfill(fillas, &filled,
+				 hpt_size / 100 * loads[i] - nfaults, nframes,
+				 nfaults);
+		if (result) {
+			kprintf("vm1: table full before %d%% load\n",
+				loads[i]);
+			break;
+		}
+
+		gettime(&before);
+		for (j=0; j<nfaults; j++) {
+			vpn = FAKE_VBASE + j * PAGE_SIZE;
+			if (hpt_lookup(faultas, vpn) != NULL) {
+				panic("vm1: found a translation never made\n");
+			}
+			if (hpt_insert(faultas, vpn, fake_pfn(filled + j),
+				       DEFAULT_CACHE_BIT, DEFAULT_DIRTY_BIT,
+				       DEFAULT_VALID_BIT) == NULL) {
+				panic("vm1: insert failed below capacity\n");
+			}
+			if (hpt_lookup(faultas, vpn) == NULL) {
+				panic("vm1: lost a translation\n");
+			}
+		}
+		gettime(&after);
+
+		kprintf("vm1: %d%% load: %u ns per fault\n", loads[i],
+			elapsed_us(&before, &after) * 1000 / nfaults);
+
+		for (j=0; j<nfaults; j++) {
+			hpt_delete(faultas, FAKE_VBASE + j * PAGE_SIZE);
+		}
+	}
+
+	for (j=0; j<filled; j++) {
+		hpt_delete(fillas, FAKE_VBASE + j * PAGE_SIZE);
+	}
+	fake_frames_release();
+	as_destroy(fillas);
+	as_destroy(faultas);
+
+	kprintf("HPT load benchmark done\n");
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// vm2
+
+/*
+ * HPT locking stress test.
+ *
+ * NWRITERS threads each insert, look up and delete WRITERPAGES fake
+ * translations under their own address space, over and over. All the
+ * writers use the same virtual pages, so their entries share buckets
+ * and lock stripes. Each thread checks that it always sees exactly its
+ * own translations, and at the end the table must be back where it
+ * started.
+ */
+
+#define NWRITERS     8
+#define WRITERPAGES  64
+#define WRITERROUNDS 50
+
+static volatile int writer_errors;
+
+static
+void
+hptwriter(void *sm, unsigned long num)
+{
+	struct semaphore *sem = sm;
+	struct addrspace *as;
+	struct hpt_entry *entry;
+	vaddr_t vpn;
+	paddr_t pfn;
+	int round, i;
+
+	as = as_create();
+	if (as == NULL) {
+		kprintf("vm2: writer %lu: as_create failed\n", num);
+		writer_errors++;
+		V(sem);
+		return;
+	}
+
+	for (round=0; round<WRITERROUNDS; round++) {
+		for (i=0; i<WRITERPAGES; i++) {
+			vpn = FAKE_VBASE + i * PAGE_SIZE;
+			pfn = fake_pfn(num * WRITERPAGES + i);
+			if (hpt_insert(as, vpn, pfn, DEFAULT_CACHE_BIT,
+				       DEFAULT_DIRTY_BIT,
+				       DEFAULT_VALID_BIT) == NULL) {
+				kprintf("vm2: writer %lu: insert failed\n",
+					num);
+				writer_errors++;
+				goto done;
+			}
+		}
+		for (i=0; i<WRITERPAGES; i++) {
+			vpn = FAKE_VBASE + i * PAGE_SIZE;
+			pfn = fake_pfn(num * WRITERPAGES + i);
+			entry = hpt_lookup(as, vpn);
+			if (entry == NULL || hpt_entry_as(entry) != as ||
+			    (entry->PFN & PAGE_FRAME) != pfn) {
+				kprintf("vm2: writer %lu: bad translation "
+					"for 0x%x\n", num, vpn);
+				writer_errors++;
+			}
+			/* delete every other page early */
+			if (i % 2 == 0) {
+				hpt_delete(as, vpn);
+			}
+		}
+		for (i=0; i<WRITERPAGES; i++) {
+			vpn = FAKE_VBASE + i * PAGE_SIZE;
+			entry = hpt_lookup(as, vpn);
+			if ((entry != NULL) != (i % 2 == 1)) {
+				kprintf("vm2: writer %lu: translation for "
+					"0x%x %s\n", num, vpn,
+					entry ? "survived delete" : "lost");
+				writer_errors++;
+			}
+			hpt_delete(as, vpn);
+		}
+		thread_yield();
+	}
+done:
+	for (i=0; i<WRITERPAGES; i++) {
+		hpt_delete(as, FAKE_VBASE + i * PAGE_SIZE);
+	}
+	as_destroy(as);
+	V(sem);
+}
+
+int
+hptstress(int nargs, char **args)
+{
+	struct semaphore *sem;
+	int nthreads, before, i, result;
+
+	nthreads = NWRITERS;
+	if (nargs == 2) {
+		nthreads = atoi(args[1]);
+	}
+	if (nthreads <= 0) {
+		kprintf("Usage: vm2 [nthreads]\n");
+		return EINVAL;
+	}
+
+	sem = sem_create("hptstress", 0);
+	if (sem == NULL) {
+		panic("hptstress: sem_create failed\n");
+	}
+
+	kprintf("Starting HPT stress test with %d writers...\n", nthreads);
+
+	if (fake_frames_reserve(nthreads * WRITERPAGES) <
+	    (unsigned)(nthreads * WRITERPAGES)) {
+		kprintf("vm2: not enough memory for %d writers\n", nthreads);
+		fake_frames_release();
+		sem_destroy(sem);
+		return ENOMEM;
+	}
+
+	writer_errors = 0;
+	before = hpt_entry_count();
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("hptstress", NULL,
+				     hptwriter, sem, i);
+		if (result) {
+			panic("hptstress: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	for (i=0; i<nthreads; i++) {
+		P(sem);
+	}
+	sem_destroy(sem);
+	fake_frames_release();
+
+	if (hpt_entry_count() != before) {
+		kprintf("vm2: %d entries leaked\n",
+			hpt_entry_count() - before);
+		writer_errors++;
+	}
+	if (writer_errors) {
+		kprintf("HPT stress test FAILED (%d errors)\n", writer_errors);
+		return EIO;
+	}
+	kprintf("HPT stress test done\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// vm3
+
+/*
+ * TLB refill throughput, lock-free hpt_lookup against the stripe
+ * locked version.
+ *
+ * REFILLPAGES translations are made under one address space, then
+ * 1, 2, 4 and 8 threads look them up round and round as a stream of
+ * refills would. The threads all hit the same few stripes, which is
+ * the worst case for the locked lookup.
+ */
+
+#define REFILLPAGES    128
+#define REFILLLOOKUPS  20000
+#define MAXREFILLERS   8
+
+static struct semaphore *refill_go;
+static struct semaphore *refill_done;
+static struct addrspace *refill_as;
+static bool refill_locked;
+
+static
+void
+refiller(void *junk, unsigned long num)
+{
+	struct hpt_entry *entry;
+	vaddr_t vpn;
+	int i;
+
+	(void)junk;
+
+	P(refill_go);
+	for (i=0; i<REFILLLOOKUPS; i++) {
+		vpn = FAKE_VBASE + ((i + num) % REFILLPAGES) * PAGE_SIZE;
+		if (refill_locked) {
+			entry = hpt_lookup_locked(refill_as, vpn);
+		}
+		else {
+			entry = hpt_lookup(refill_as, vpn);
+		}
+		if (entry == NULL) {
+			panic("vm3: refiller %lu lost 0x%x\n", num, vpn);
+		}
+	}
+	V(refill_done);
+}
+
+static
+unsigned
+refillrun(int nthreads, bool locked)
+{
+	struct timespec before, after;
+	unsigned us;
+	int i, result;
+
+	refill_locked = locked;
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("refiller", NULL, refiller, NULL, i);
+		if (result) {
+			panic("vm3: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	gettime(&before);
+	for (i=0; i<nthreads; i++) {
+		V(refill_go);
+	}
+	for (i=0; i<nthreads; i++) {
+		P(refill_done);
+	}
+	gettime(&after);
+
+	/* refills per millisecond */
+	us = elapsed_us(&before, &after);
+	if (us < 1000) {
+		us = 1000;
+	}
+	return nthreads * REFILLLOOKUPS / (us / 1000);
+}
+
+int
+hptrefillbench(int nargs, char **args)
+{
+	int nthreads, i;
+	unsigned lockfree, locked;
+
+	(void)nargs;
+	(void)args;
+
+	refill_as = as_create();
+	refill_go = sem_create("refill_go", 0);
+	refill_done = sem_create("refill_done", 0);
+	if (refill_as == NULL || refill_go == NULL || refill_done == NULL) {
+		panic("vm3: out of memory\n");
+	}
+
+	if (fake_frames_reserve(REFILLPAGES) < REFILLPAGES) {
+		panic("vm3: out of memory\n");
+	}
+	for (i=0; i<REFILLPAGES; i++) {
+		if (hpt_insert(refill_as, FAKE_VBASE + i * PAGE_SIZE,
+			       fake_pfn(i), DEFAULT_CACHE_BIT,
+			       DEFAULT_DIRTY_BIT, DEFAULT_VALID_BIT) == NULL) {
+			panic("vm3: hpt_insert failed\n");
+		}
+	}
+
+	kprintf("Starting refill benchmark...\n");
+	for (nthreads=1; nthreads<=MAXREFILLERS; nthreads*=2) {
+		locked = refillrun(nthreads, true);
+		lockfree = refillrun(nthreads, false);
+		kprintf("vm3: %d threads: %u refills/ms locked, "
+			"%u refills/ms lock-free\n",
+			nthreads, locked, lockfree);
+	}
+
+	for (i=0; i<REFILLPAGES; i++) {
+		hpt_delete(refill_as, FAKE_VBASE + i * PAGE_SIZE);
+	}
+	fake_frames_release();
+	sem_destroy(refill_go);
+	sem_destroy(refill_done);
+	as_destroy(refill_as);
+
+	kprintf("Refill benchmark done\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// vm4
+
+/*
+ * Batch insert/delete against one page at a time.
+ *
+ * BATCHPAGES fake translations (what a fork or exit of a process with
+ * that many resident pages does to the HPT) are inserted and deleted
+ * BATCHROUNDS times with hpt_insert/hpt_delete, then the same with
+ * hpt_insert_batch/hpt_delete_batch. The batch round is checked: every
+ * page must be found with the right frame, and the old frame must come
+ * back from the delete.
+ */
+
+#define BATCHPAGES   HPT_BATCH_MAX
+#define BATCHROUNDS  20
+
+static
+int
+batchcheck(struct addrspace *as, struct hpt_batch_item *items, unsigned n)
+{
+	struct hpt_entry *entry;
+	unsigned i;
+
+	if (hpt_insert_batch(as, items, n, DEFAULT_CACHE_BIT,
+			     DEFAULT_DIRTY_BIT, DEFAULT_VALID_BIT) != (int)n) {
+		kprintf("vm4: hpt_insert_batch came up short\n");
+		return EIO;
+	}
+	for (i=0; i<n; i++) {
+		entry = hpt_lookup(as, items[i].VPN);
+		if (entry == NULL || entry != items[i].entry ||
+		    (entry->PFN & PAGE_FRAME) != fake_pfn(i)) {
+			kprintf("vm4: bad translation for 0x%x\n",
+				items[i].VPN);
+			return EIO;
+		}
+	}
+	if (hpt_delete_batch(as, items, n) != (int)n) {
+		kprintf("vm4: hpt_delete_batch came up short\n");
+		return EIO;
+	}
+	for (i=0; i<n; i++) {
+		if ((items[i].PFN & PAGE_FRAME) != fake_pfn(i) ||
+		    hpt_lookup(as, items[i].VPN) != NULL) {
+			kprintf("vm4: 0x%x not deleted properly\n",
+				items[i].VPN);
+			return EIO;
+		}
+	}
+	return 0;
+}
+
+int
+hptbatchbench(int nargs, char **args)
+{
+	struct hpt_batch_item *items;
+	struct addrspace *as;
+	struct timespec before, after;
+	unsigned single, batch, i;
+	int round, entries, result;
+
+	(void)nargs;
+	(void)args;
+
+	as = as_create();
+	items = kmalloc(sizeof(*items) * BATCHPAGES);
+	if (as == NULL || items == NULL) {
+		panic("vm4: out of memory\n");
+	}
+	if (fake_frames_reserve(BATCHPAGES) < BATCHPAGES) {
+		panic("vm4: out of memory\n");
+	}
+
+	kprintf("Starting HPT batch benchmark (%u pages)...\n", BATCHPAGES);
+	entries = hpt_entry_count();
+
+	gettime(&before);
+	for (round=0; round<BATCHROUNDS; round++) {
+		for (i=0; i<BATCHPAGES; i++) {
+			if (hpt_insert(as, FAKE_VBASE + i * PAGE_SIZE,
+				       fake_pfn(i), DEFAULT_CACHE_BIT,
+				       DEFAULT_DIRTY_BIT,
+				       DEFAULT_VALID_BIT) == NULL) {
+				panic("vm4: hpt_insert failed\n");
+			}
+		}
+		for (i=0; i<BATCHPAGES; i++) {
+			hpt_delete(as, FAKE_VBASE + i * PAGE_SIZE);
+		}
+	}
+	gettime(&after);
+	single = elapsed_us(&before, &after);
+
+	result = 0;
+	gettime(&before);
+	for (round=0; round<BATCHROUNDS && result == 0; round++) {
+		for (i=0; i<BATCHPAGES; i++) {
+			items[i].VPN = FAKE_VBASE + i * PAGE_SIZE;
+			items[i].PFN = fake_pfn(i);
+		}
+		result = batchcheck(as, items, BATCHPAGES);
+	}
+	gettime(&after);
+	batch = elapsed_us(&before, &after);
+
+	if (hpt_entry_count() != entries) {
+		kprintf("vm4: %d entries leaked\n",
+			hpt_entry_count() - entries);
+		result = EIO;
+	}
+
+	kfree(items);
+	fake_frames_release();
+	as_destroy(as);
+
+	if (result) {
+		kprintf("HPT batch benchmark FAILED\n");
+		return result;
+	}
+	/* the batch time includes the checking lookups */
+	kprintf("vm4: %u us one page at a time, %u us batched\n",
+		single, batch);
+	kprintf("HPT batch benchmark done\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// vm5
+
+/*
+ * HPT resize test.
+ *
+ * Fake translations are added until there are RESIZELOAD entries per
+ * bucket of the starting size, calling hpt_rehash_step after each one
+ * as vm_fault does, so the table grows and rehashes while it fills.
+ * Every translation made so far is checked every RESIZECHECK inserts.
+ * Then they are all deleted the same way, and the table has to shrink
+ * again.
+ */
+
+#define RESIZELOAD   4
+#define RESIZECHECK  64
+
+static
+int
+resizecheck(struct addrspace *as, unsigned n)
+{
+	struct hpt_entry *entry;
+	unsigned i;
+
+	for (i=0; i<n; i++) {
+		entry = hpt_lookup(as, FAKE_VBASE + i * PAGE_SIZE);
+		if (entry == NULL ||
+		    (entry->PFN & PAGE_FRAME) != fake_pfn(i)) {
+			kprintf("vm5: lost translation %u of %u "
+				"(%d buckets)\n", i, n, hpt_size);
+			return EIO;
+		}
+	}
+	return 0;
+}
+
+int
+hptresizetest(int nargs, char **args)
+{
+	struct addrspace *as;
+	unsigned n, i, j;
+	int startsize, peaksize, result;
+
+	(void)nargs;
+	(void)args;
+
+	as = as_create();
+	if (as == NULL) {
+		panic("vm5: as_create failed\n");
+	}
+
+	startsize = hpt_size;
+	n = fake_frames_reserve(startsize * RESIZELOAD);
+	kprintf("Starting HPT resize test (%d buckets, %u pages)...\n",
+		startsize, n);
+
+	result = 0;
+	peaksize = startsize;
+	for (i=0; i<n && result == 0; i++) {
+		if (hpt_insert(as, FAKE_VBASE + i * PAGE_SIZE, fake_pfn(i),
+			       DEFAULT_CACHE_BIT, DEFAULT_DIRTY_BIT,
+			       DEFAULT_VALID_BIT) == NULL) {
+			kprintf("vm5: table full after %u pages\n", i);
+			break;
+		}
+		hpt_rehash_step();
+		if (hpt_size > peaksize) {
+			peaksize = hpt_size;
+		}
+		if (i % RESIZECHECK == 0) {
+			result = resizecheck(as, i + 1);
+		}
+	}
+	n = i;
+	if (result == 0) {
+		result = resizecheck(as, n);
+	}
+	kprintf("vm5: %u pages in %d buckets\n", n, peaksize);
+	if (result == 0 && peaksize == startsize) {
+		kprintf("vm5: table never grew\n");
+		result = EIO;
+	}
+
+	for (i=n; i-- > 0; ) {
+		hpt_delete(as, FAKE_VBASE + i * PAGE_SIZE);
+		hpt_rehash_step();
+		if (result == 0 && i % RESIZECHECK == 0) {
+			result = resizecheck(as, i);
+		}
+	}
+	/* let any rehash that is still going finish */
+	for (j=0; j<(1 << HPT_MAX_ORDER); j++) {
+		hpt_rehash_step();
+	}
+	hpt_printsize();
+	if (result == 0 && hpt_size >= peaksize) {
+		kprintf("vm5: table never shrank\n");
+		result = EIO;
+	}
+
+	fake_frames_release();
+	as_destroy(as);
+
+	if (result) {
+		kprintf("HPT resize test FAILED\n");
+		return result;
+	}
+	kprintf("HPT resize test done\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// vm6
+
+/*
+ * Context-switch TLB refill benchmark.
+ *
+ * SWITCHSPACES address spaces, each with SWITCHPAGES real pages at the
+ * same addresses, take turns the way processes on a busy cpu do: the
+ * address space is made current, as_activate is called as on a
+ * context switch, and every page is touched. This is done once
+ * flushing the whole TLB after each as_activate, as it used to, and
+ * once relying on ASIDs; the TLB refills (faults satisfied from the
+ * page table) per switch are printed for both. The pages count how
+ * often each address space touched them, which also shows that no
+ * address space saw another one's pages through a stale TLB entry.
+ */
+
+#define SWITCHSPACES 4
+#define SWITCHPAGES  6
+#define SWITCHROUNDS 200
+
+static
+void
+switchrun(struct addrspace **spaces, bool flush, unsigned *refills,
+	  unsigned *us)
+{
+	struct vmstats before, after;
+	struct timespec tbefore, tafter;
+	volatile int *page;
+	int round, i, j, spl;
+
+	vmstats_total(&before);
+	gettime(&tbefore);
+	for (round=0; round<SWITCHROUNDS; round++) {
+		for (i=0; i<SWITCHSPACES; i++) {
+			proc_setas(spaces[i]);
+			as_activate();
+			if (flush) {
+				spl = splhigh();
+				vm_tlb_flush();
+				splx(spl);
+			}
+			for (j=0; j<SWITCHPAGES; j++) {
+				page = (volatile int *)
+					(FAKE_VBASE + j * PAGE_SIZE);
+				(*page)++;
+			}
+		}
+	}
+	gettime(&tafter);
+	vmstats_total(&after);
+	*refills = after.vs_refills - before.vs_refills;
+	*us = elapsed_us(&tbefore, &tafter);
+}
+
+int
+asidbench(int nargs, char **args)
+{
+	struct addrspace *spaces[SWITCHSPACES], *oldas;
+	unsigned flushrefills, flushus, asidrefills, asidus, switches;
+	volatile int *page;
+	int i, j, result;
+
+	(void)nargs;
+	(void)args;
+
+	for (i=0; i<SWITCHSPACES; i++) {
+		spaces[i] = as_create();
+		if (spaces[i] == NULL ||
+		    as_define_region(spaces[i], FAKE_VBASE,
+				     SWITCHPAGES * PAGE_SIZE, 1, 1, 0)) {
+			panic("vm6: out of memory\n");
+		}
+	}
+
+	kprintf("Starting context switch benchmark "
+		"(%d address spaces, %d pages each)...\n",
+		SWITCHSPACES, SWITCHPAGES);
+
+	oldas = proc_setas(NULL);
+
+	/* fault every page in, so only refills are left to count */
+	for (i=0; i<SWITCHSPACES; i++) {
+		proc_setas(spaces[i]);
+		as_activate();
+		for (j=0; j<SWITCHPAGES; j++) {
+			page = (volatile int *)(FAKE_VBASE + j * PAGE_SIZE);
+			*page = 0;
+		}
+	}
+
+	switchrun(spaces, true, &flushrefills, &flushus);
+	switchrun(spaces, false, &asidrefills, &asidus);
+
+	result = 0;
+	for (i=0; i<SWITCHSPACES; i++) {
+		proc_setas(spaces[i]);
+		as_activate();
+		for (j=0; j<SWITCHPAGES; j++) {
+			page = (volatile int *)(FAKE_VBASE + j * PAGE_SIZE);
+			if (*page != 2 * SWITCHROUNDS) {
+				kprintf("vm6: space %d page %d counted %d, "
+					"expected %d\n", i, j, *page,
+					2 * SWITCHROUNDS);
+				result = EIO;
+			}
+		}
+	}
+
+	proc_setas(oldas);
+	as_activate();
+	for (i=0; i<SWITCHSPACES; i++) {
+		as_destroy(spaces[i]);
+	}
+
+	if (result) {
+		kprintf("Context switch benchmark FAILED\n");
+		return result;
+	}
+	switches = SWITCHROUNDS * SWITCHSPACES;
+	kprintf("vm6: flushing: %u refills in %u switches (%u us)\n",
+		flushrefills, switches, flushus);
+	kprintf("vm6: ASIDs:    %u refills in %u switches (%u us)\n",
+		asidrefills, switches, asidus);
+	vmstats_print();
+	kprintf("Context switch benchmark done\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// vm7
+
+/*
+ * Frame free benchmark.
+ *
+ * First FREEPAGES frames are taken with alloc_kpages and given back
+ * with free_kpages in a scattered order, as kfree of unrelated
+ * allocations would. Then a process exit is imitated: an address
+ * space gets EXITPAGES pages faulted in and is destroyed, EXITROUNDS
+ * times. Both report frees per second.
+ */
+
+#define FREEPAGES   (PAGE_SIZE / sizeof(vaddr_t))
+#define FREESTRIDE  7919	/* prime, so i*FREESTRIDE % n visits all */
+#define EXITPAGES   256
+#define EXITROUNDS  4
+
+static
+unsigned
+freerate(unsigned nfrees, unsigned us)
+{
+	if (us == 0) {
+		us = 1;
+	}
+	return (unsigned)((uint64_t)nfrees * 1000000 / us);
+}
+
+int
+ftfreebench(int nargs, char **args)
+{
+	struct addrspace *as, *oldas;
+	struct timespec before, after;
+	vaddr_t *pages;
+	volatile int *page;
+	unsigned n, i, freeus, exitus;
+	int round;
+
+	(void)nargs;
+	(void)args;
+
+	pages = kmalloc(FREEPAGES * sizeof(vaddr_t));
+	if (pages == NULL) {
+		panic("vm7: out of memory\n");
+	}
+
+	kprintf("Starting frame free benchmark...\n");
+
+	for (n=0; n<FREEPAGES; n++) {
+		pages[n] = alloc_kpages(1);
+		if (pages[n] == 0) {
+			break;
+		}
+	}
+	if (n > 0 && n % FREESTRIDE == 0) {
+		/* keep the stride coprime to n; this frees one page early */
+		free_kpages(pages[--n]);
+	}
+
+	gettime(&before);
+	for (i=0; i<n; i++) {
+		free_kpages(pages[(i * FREESTRIDE) % n]);
+	}
+	gettime(&after);
+	freeus = elapsed_us(&before, &after);
+	kfree(pages);
+
+	oldas = proc_setas(NULL);
+	exitus = 0;
+	for (round=0; round<EXITROUNDS; round++) {
+		as = as_create();
+		if (as == NULL ||
+		    as_define_region(as, FAKE_VBASE, EXITPAGES * PAGE_SIZE,
+				     1, 1, 0)) {
+			panic("vm7: out of memory\n");
+		}
+		proc_setas(as);
+		as_activate();
+		for (i=0; i<EXITPAGES; i++) {
+			page = (volatile int *)(FAKE_VBASE + i * PAGE_SIZE);
+			*page = i;
+		}
+		proc_setas(oldas);
+
+		gettime(&before);
+		as_destroy(as);
+		gettime(&after);
+		exitus += elapsed_us(&before, &after);
+	}
+	as_activate();
+
+	kprintf("vm7: %u scattered frees in %u us, %u frees/s\n",
+		n, freeus, freerate(n, freeus));
+	kprintf("vm7: %u exits of %u pages in %u us, %u frees/s\n",
+		EXITROUNDS, EXITPAGES, exitus,
+		freerate(EXITROUNDS * EXITPAGES, exitus));
+	kprintf("Frame free benchmark done\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// vm8
+
+/*
+ * Multi-page allocation test.
+ *
+ * Runs of BUDDYSIZES sizes are allocated, several of each, with
+ * alloc_kpages and with kmalloc. Each run must be aligned to its
+ * block size and is filled with its own pattern; after everything is
+ * allocated the patterns are checked, which catches overlapping runs.
+ * The runs are then freed in a different order and the number of free
+ * frames has to come back to where it started, which only happens if
+ * free_kpages recovered every run's length.
+ */
+
+#define BUDDYCOPIES 4
+
+static const unsigned buddysizes[] = { 1, 2, 3, 4, 7, 8, 16, 17 };
+#define BUDDYSIZES (sizeof(buddysizes) / sizeof(buddysizes[0]))
+#define BUDDYRUNS  (BUDDYSIZES * BUDDYCOPIES)
+
+static
+unsigned
+buddyblock(unsigned npages)
+{
+	unsigned block = 1;
+
+	while (block < npages) {
+		block *= 2;
+	}
+	return block;
+}
+
+int
+buddytest(int nargs, char **args)
+{
+	vaddr_t runs[BUDDYRUNS];
+	unsigned npages[BUDDYRUNS];
+	uint32_t *words;
+	unsigned i, j, nwords, failed;
+	int startfree;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting multi-page allocation test...\n");
+	startfree = frame_table_free_count();
+	failed = 0;
+
+	for (i=0; i<BUDDYRUNS; i++) {
+		npages[i] = buddysizes[i % BUDDYSIZES];
+		if (i % 2 == 0) {
+			runs[i] = alloc_kpages(npages[i]);
+		} else {
+			runs[i] = (vaddr_t)kmalloc(npages[i] * PAGE_SIZE);
+		}
+		if (runs[i] == 0) {
+			kprintf("vm8: %u page run %u failed\n", npages[i], i);
+			failed++;
+			continue;
+		}
+		if (runs[i] % (buddyblock(npages[i]) * PAGE_SIZE) != 0) {
+			kprintf("vm8: %u page run at 0x%x is misaligned\n",
+				npages[i], runs[i]);
+			failed++;
+		}
+		words = (uint32_t *)runs[i];
+		nwords = npages[i] * PAGE_SIZE / sizeof(uint32_t);
+		for (j=0; j<nwords; j++) {
+			words[j] = i * 0x10001 + j;
+		}
+	}
+
+	for (i=0; i<BUDDYRUNS; i++) {
+		if (runs[i] == 0) {
+			continue;
+		}
+		words = (uint32_t *)runs[i];
+		nwords = npages[i] * PAGE_SIZE / sizeof(uint32_t);
+		for (j=0; j<nwords; j++) {
+			if (words[j] != i * 0x10001 + j) {
+				kprintf("vm8: run %u overwritten at word %u\n",
+					i, j);
+				failed++;
+				break;
+			}
+		}
+	}
+
+	/* odd runs first, then even ones from the top down */
+	for (i=1; i<BUDDYRUNS; i+=2) {
+		kfree((void *)runs[i]);
+	}
+	for (i=BUDDYRUNS; i-- > 0; ) {
+		if (i % 2 == 0 && runs[i] != 0) {
+			free_kpages(runs[i]);
+		}
+	}
+
+	frame_table_printstats();
+	if (frame_table_free_count() != startfree) {
+		kprintf("vm8: %d frames free, %d before\n",
+			frame_table_free_count(), startfree);
+		failed++;
+	}
+
+	if (failed) {
+		kprintf("Multi-page allocation test FAILED\n");
+		return EIO;
+	}
+	kprintf("Multi-page allocation test done\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// vm9
+
+/*
+ * Frame allocation throughput with and without the per-cpu magazines.
+ *
+ * 1 to MAXFRAMERS threads each take FRAMEBURST single frames and give
+ * them back, FRAMEROUNDS times: the frame traffic of faulting in
+ * pages and then exiting. With more threads than one they run on
+ * several cpus and all meet at frame_table_lock unless the magazines
+ * keep them apart. The magazine size for the cached runs can be given
+ * as an argument; it is reset to FT_MAGAZINE_SIZE afterwards.
+ */
+
+#define FRAMEBURST   16
+#define FRAMEROUNDS  500
+#define MAXFRAMERS   8
+
+static struct semaphore *framer_go;
+static struct semaphore *framer_done;
+
+static
+void
+framer(void *junk, unsigned long num)
+{
+	vaddr_t frames[FRAMEBURST];
+	int round, i;
+
+	(void)junk;
+
+	P(framer_go);
+	for (round=0; round<FRAMEROUNDS; round++) {
+		for (i=0; i<FRAMEBURST; i++) {
+			frames[i] = alloc_kpages(1);
+			if (frames[i] == 0) {
+				panic("vm9: framer %lu out of memory\n", num);
+			}
+		}
+		for (i=0; i<FRAMEBURST; i++) {
+			free_kpages(frames[i]);
+		}
+	}
+	V(framer_done);
+}
+
+static
+unsigned
+framerun(int nthreads, unsigned magsize)
+{
+	struct timespec before, after;
+	unsigned us;
+	int i, result;
+
+	frame_table_set_magazine(magsize);
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("framer", NULL, framer, NULL, i);
+		if (result) {
+			panic("vm9: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	gettime(&before);
+	for (i=0; i<nthreads; i++) {
+		V(framer_go);
+	}
+	for (i=0; i<nthreads; i++) {
+		P(framer_done);
+	}
+	gettime(&after);
+
+	/* allocations per millisecond */
+	us = elapsed_us(&before, &after);
+	if (us < 1000) {
+		us = 1000;
+	}
+	return nthreads * FRAMEROUNDS * FRAMEBURST / (us / 1000);
+}
+
+int
+magazinebench(int nargs, char **args)
+{
+	unsigned magsize, cached, uncached;
+	int nthreads;
+
+	magsize = FT_MAGAZINE_SIZE;
+	if (nargs > 1) {
+		magsize = atoi(args[1]);
+	}
+	if (magsize == 0 || magsize > FT_MAGAZINE_SIZE) {
+		kprintf("Usage: vm9 [magazine size, 1-%d]\n",
+			FT_MAGAZINE_SIZE);
+		return EINVAL;
+	}
+
+	framer_go = sem_create("framer_go", 0);
+	framer_done = sem_create("framer_done", 0);
+	if (framer_go == NULL || framer_done == NULL) {
+		panic("vm9: out of memory\n");
+	}
+
+	kprintf("Starting frame allocation benchmark (%u cpus, "
+		"magazines of %u)...\n", cpu_count(), magsize);
+	for (nthreads=1; nthreads<=MAXFRAMERS; nthreads*=2) {
+		uncached = framerun(nthreads, 0);
+		cached = framerun(nthreads, magsize);
+		kprintf("vm9: %d threads: %u allocs/ms uncached, "
+			"%u allocs/ms with magazines\n",
+			nthreads, uncached, cached);
+	}
+	frame_table_set_magazine(FT_MAGAZINE_SIZE);
+	frame_table_printstats();
+
+	sem_destroy(framer_go);
+	sem_destroy(framer_done);
+
+	kprintf("Frame allocation benchmark done\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// vm10
+
+/*
+ * New-page fault latency with and without the pre-zeroed pool.
+ *
+ * ZEROPAGES pages of a fresh address space are faulted in by touching
+ * them, as in vm6. This is done once with the pool switched off, so
+ * every fault zeroes its frame itself, and once after giving the
+ * zeroing thread time to fill the pool.
+ */
+
+#define ZEROPAGES  32
+#define ZEROWAIT   10000	/* yields to wait for the pool to fill */
+
+static
+unsigned
+zerorun(void)
+{
+	struct addrspace *as, *oldas;
+	struct timespec before, after;
+	volatile int *page;
+	unsigned i;
+
+	as = as_create();
+	if (as == NULL ||
+	    as_define_region(as, FAKE_VBASE, ZEROPAGES * PAGE_SIZE,
+			     1, 1, 0)) {
+		panic("vm10: out of memory\n");
+	}
+	oldas = proc_setas(as);
+	as_activate();
+
+	gettime(&before);
+	for (i=0; i<ZEROPAGES; i++) {
+		page = (volatile int *)(FAKE_VBASE + i * PAGE_SIZE);
+		if (*page != 0) {
+			panic("vm10: new page 0x%x not zeroed\n",
+			      (vaddr_t)page);
+		}
+	}
+	gettime(&after);
+
+	proc_setas(oldas);
+	as_activate();
+	as_destroy(as);
+	return elapsed_us(&before, &after);
+}
+
+int
+zerobench(int nargs, char **args)
+{
+	unsigned sync, pooled, i;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting zero-fill fault benchmark (%d pages)...\n",
+		ZEROPAGES);
+
+	frame_table_set_zero_pool(false);
+	sync = zerorun();
+	frame_table_set_zero_pool(true);
+
+	for (i=0; i<ZEROWAIT && frame_table_zeroed_count() < ZEROPAGES; i++) {
+		thread_yield();
+	}
+	kprintf("vm10: %u frames in the pool\n", frame_table_zeroed_count());
+	pooled = zerorun();
+
+	kprintf("vm10: %u us per fault zeroing, %u us per fault pre-zeroed\n",
+		sync / ZEROPAGES, pooled / ZEROPAGES);
+	vmstats_print();
+	kprintf("Zero-fill fault benchmark done\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// vm11
+
+/*
+ * Frame reference counts and reverse maps.
+ *
+ * First a kernel page gets extra references and reverse map entries
+ * for a couple of scratch address spaces, which must be counted and
+ * dropped again in any order. Then (not with the inverted page
+ * table, where a frame has only the one translation) RMAPPAGES pages
+ * faulted into one address space are also mapped into a second one;
+ * they must survive the first address space going away, still hold
+ * what was written to them, and go away with the second.
+ */
+
+#define RMAPPAGES  16
+
+static
+void
+rmapexpect(paddr_t pa, unsigned refs, unsigned maps)
+{
+	if (frame_refcount(pa) != refs || frame_rmap_count(pa) != maps) {
+		panic("vm11: frame 0x%x has %u references and %u mappings, "
+		      "expected %u and %u\n", pa, frame_refcount(pa),
+		      frame_rmap_count(pa), refs, maps);
+	}
+}
+
+#if !OPT_IPT
+static
+void
+rmapshare(void)
+{
+	struct addrspace *as1, *as2, *oldas;
+	struct region *r;
+	struct hpt_entry *e;
+	volatile int *page;
+	paddr_t pa[RMAPPAGES];
+	unsigned i;
+
+	as1 = as_create();
+	as2 = as_create();
+	if (as1 == NULL || as2 == NULL ||
+	    as_define_region(as1, FAKE_VBASE, RMAPPAGES * PAGE_SIZE,
+			     1, 1, 0) ||
+	    as_define_region(as2, FAKE_VBASE, RMAPPAGES * PAGE_SIZE,
+			     1, 1, 0)) {
+		panic("vm11: out of memory\n");
+	}
+
+	oldas = proc_setas(as1);
+	as_activate();
+	for (i=0; i<RMAPPAGES; i++) {
+		page = (volatile int *)(FAKE_VBASE + i * PAGE_SIZE);
+		*page = i;
+	}
+	proc_setas(oldas);
+	as_activate();
+
+	r = vaddr_region_mapping(as2, FAKE_VBASE);
+	for (i=0; i<RMAPPAGES; i++) {
+		e = hpt_lookup(as1, FAKE_VBASE + i * PAGE_SIZE);
+		KASSERT(e != NULL);
+		pa[i] = e->PFN & PAGE_FRAME;
+		rmapexpect(pa[i], 1, 1);
+
+		frame_ref(pa[i]);
+		if (frame_rmap_add(pa[i], as2, FAKE_VBASE + i * PAGE_SIZE)) {
+			panic("vm11: out of memory\n");
+		}
+		if (hpt_insert(as2, FAKE_VBASE + i * PAGE_SIZE, pa[i],
+			       DEFAULT_CACHE_BIT, 1, DEFAULT_VALID_BIT) == NULL) {
+			panic("vm11: out of memory\n");
+		}
+		region_mark_resident(as2, r, FAKE_VBASE + i * PAGE_SIZE);
+		rmapexpect(pa[i], 2, 2);
+	}
+#if OPT_VMDEBUG
+	frame_table_check_as(as1);
+	frame_table_check_as(as2);
+#endif
+
+	as_destroy(as1);
+	for (i=0; i<RMAPPAGES; i++) {
+		rmapexpect(pa[i], 1, 1);
+	}
+
+	oldas = proc_setas(as2);
+	as_activate();
+	for (i=0; i<RMAPPAGES; i++) {
+		page = (volatile int *)(FAKE_VBASE + i * PAGE_SIZE);
+		if (*page != (int)i) {
+			panic("vm11: shared page 0x%x lost its contents\n",
+			      (vaddr_t)page);
+		}
+	}
+	proc_setas(oldas);
+	as_activate();
+
+	as_destroy(as2);
+	for (i=0; i<RMAPPAGES; i++) {
+		rmapexpect(pa[i], 0, 0);
+	}
+	kprintf("vm11: %d shared pages outlived their first owner\n",
+		RMAPPAGES);
+}
+#endif
+
+int
+rmaptest(int nargs, char **args)
+{
+	struct addrspace *as1, *as2;
+	vaddr_t kva;
+	paddr_t pa;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting reference count and reverse map test...\n");
+
+	as1 = as_create();
+	as2 = as_create();
+	kva = alloc_kpages(1);
+	if (as1 == NULL || as2 == NULL || kva == 0) {
+		panic("vm11: out of memory\n");
+	}
+	pa = KVADDR_TO_PADDR(kva);
+	rmapexpect(pa, 1, 0);
+
+	frame_ref(pa);
+	frame_ref(pa);
+	rmapexpect(pa, 3, 0);
+	if (frame_rmap_add(pa, as1, FAKE_VBASE) ||
+	    frame_rmap_add(pa, as2, FAKE_VBASE) ||
+	    frame_rmap_add(pa, as2, FAKE_VBASE + PAGE_SIZE)) {
+		panic("vm11: out of memory\n");
+	}
+	rmapexpect(pa, 3, 3);
+#if OPT_VMDEBUG
+	frame_table_check();
+#endif
+
+	/* the one in the frame table entry first, then from the chain */
+	frame_rmap_remove(pa, as1, FAKE_VBASE);
+	rmapexpect(pa, 3, 2);
+	frame_rmap_remove(pa, as2, FAKE_VBASE + PAGE_SIZE);
+	rmapexpect(pa, 3, 1);
+	frame_rmap_remove(pa, as2, FAKE_VBASE);
+	rmapexpect(pa, 3, 0);
+
+	if (frame_unref(pa) || frame_unref(pa)) {
+		panic("vm11: frame freed with references left\n");
+	}
+	rmapexpect(pa, 1, 0);
+	if (!frame_unref(pa)) {
+		panic("vm11: frame not freed by its last reference\n");
+	}
+	as_destroy(as1);
+	as_destroy(as2);
+	kprintf("vm11: kernel page references ok\n");
+
+#if !OPT_IPT
+	rmapshare();
+#endif
+#if OPT_VMDEBUG
+	frame_table_check();
+#endif
+	kprintf("Reference count and reverse map test done\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// vm12
+
+/*
+ * Memory accounting.
+ *
+ * Faulting MEMPAGES pages into a fresh address space must charge
+ * exactly that many frames to user memory and to the address space's
+ * RSS, and destroying it must give them back. Kernel heap pages from
+ * alloc_kpages must not count as user memory.
+ */
+
+#define MEMPAGES  32
+
+static
+void
+memexpect(const char *what, unsigned got, unsigned expected)
+{
+	if (got != expected) {
+		panic("vm12: %s is %u, expected %u\n", what, got, expected);
+	}
+}
+
+int
+meminfotest(int nargs, char **args)
+{
+	struct addrspace *as, *oldas;
+	struct meminfo before, mi;
+	volatile int *page;
+	vaddr_t kva;
+	unsigned i;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting memory accounting test...\n");
+
+	frame_table_meminfo(&before);
+
+	kva = alloc_kpages(1);
+	if (kva == 0) {
+		panic("vm12: out of memory\n");
+	}
+	frame_table_meminfo(&mi);
+	memexpect("user memory", mi.mi_user, before.mi_user);
+	if (mi.mi_kheap <= before.mi_kheap) {
+		panic("vm12: kernel page not charged to the heap\n");
+	}
+	free_kpages(kva);
+
+	as = as_create();
+	if (as == NULL ||
+	    as_define_region(as, FAKE_VBASE, MEMPAGES * PAGE_SIZE,
+			     1, 1, 0)) {
+		panic("vm12: out of memory\n");
+	}
+	oldas = proc_setas(as);
+	as_activate();
+	for (i=0; i<MEMPAGES; i++) {
+		page = (volatile int *)(FAKE_VBASE + i * PAGE_SIZE);
+		*page = i;
+	}
+	proc_setas(oldas);
+	as_activate();
+
+	frame_table_meminfo(&mi);
+	memexpect("RSS", as->rss, MEMPAGES);
+	memexpect("user memory", mi.mi_user, before.mi_user + MEMPAGES);
+	kprintf("vm12: %u of %u pages accounted for\n",
+		mi.mi_kernel + mi.mi_kheap + mi.mi_user + mi.mi_pgtable +
+		mi.mi_filecache + mi.mi_free, mi.mi_total);
+
+	as_destroy(as);
+	frame_table_meminfo(&mi);
+	memexpect("user memory", mi.mi_user, before.mi_user);
+
+	kprintf("Memory accounting test done\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// vm13
+
+/*
+ * Watermarks.
+ *
+ * Kernel pages are taken until free memory is below FT_WMARK_MIN. A
+ * user allocation must then be throttled and fail, since nothing the
+ * reclaimer can do frees the pages held here, while a kernel
+ * allocation still gets a frame from the reserve. Once everything is
+ * given back, a user allocation must succeed again.
+ */
+
+static
+vaddr_t
+wmarkeat(unsigned *npages)
+{
+	vaddr_t head = 0, va;
+
+	*npages = 0;
+	while (frame_table_avail() >= FT_WMARK_MIN) {
+		va = alloc_kpages_flags(1, 0);
+		if (va == 0) {
+			break;
+		}
+		/* chain the pages through their first word */
+		*(vaddr_t *)va = head;
+		head = va;
+		(*npages)++;
+	}
+	return head;
+}
+
+int
+wmarktest(int nargs, char **args)
+{
+	struct vmstats before, after;
+	vaddr_t head, next, va;
+	unsigned npages;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting watermark test...\n");
+	vmstats_total(&before);
+
+	head = wmarkeat(&npages);
+	kprintf("vm13: took %u pages, %d free\n", npages, frame_table_avail());
+	if (frame_table_avail() >= FT_WMARK_MIN) {
+		panic("vm13: could not get below the min watermark\n");
+	}
+
+	va = alloc_kpages_flags(1, AKP_USER);
+	if (va != 0) {
+		panic("vm13: user allocation below min succeeded\n");
+	}
+	va = frame_table_avail() > 0 ? alloc_kpages(1) : 0;
+	if (va != 0) {
+		free_kpages(va);
+	}
+
+	while (head != 0) {
+		next = *(vaddr_t *)head;
+		free_kpages(head);
+		head = next;
+	}
+
+	va = alloc_kpages_flags(1, AKP_USER);
+	if (va == 0) {
+		panic("vm13: user allocation failed with memory free\n");
+	}
+	free_kpages(va);
+
+	vmstats_total(&after);
+	if (after.vs_throttle == before.vs_throttle ||
+	    after.vs_throttle_fail == before.vs_throttle_fail) {
+		panic("vm13: throttled allocation not counted\n");
+	}
+	if (after.vs_reserve == before.vs_reserve) {
+		panic("vm13: kernel allocation from the reserve not counted\n");
+	}
+	vmstats_print();
+	kprintf("Watermark test done\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// vm14
+
+/*
+ * TLB refill cost with and without the vm_fault fast path.
+ *
+ * An address space gets FASTREGIONS one-page regions in front of a
+ * region of FASTPAGES pages, so the region walk has some length to it,
+ * as in a program with text, data, bss, heap and stack. The pages are
+ * faulted in once; then each round flushes the TLB and touches them
+ * all again, so every touch is a refill. This is done with the fast
+ * path switched off and on.
+ */
+
+#define FASTREGIONS  8
+#define FASTPAGES    32
+#define FASTROUNDS   200
+
+static
+unsigned
+fastrun(bool fast)
+{
+	struct timespec before, after;
+	volatile int *page;
+	unsigned i, round;
+	int spl;
+
+	vm_set_fastpath(fast);
+	/* every touch a refill */
+	vm_set_tlb_prefetch(0);
+	gettime(&before);
+	for (round=0; round<FASTROUNDS; round++) {
+		spl = splhigh();
+		vm_tlb_flush();
+		splx(spl);
+		for (i=0; i<FASTPAGES; i++) {
+			page = (volatile int *)(FAKE_VBASE + i * PAGE_SIZE);
+			(void)*page;
+		}
+	}
+	gettime(&after);
+	vm_set_fastpath(true);
+	vm_set_tlb_prefetch(TLB_PREFETCH_MAX);
+
+	return elapsed_us(&before, &after);
+}
+
+int
+fastpathbench(int nargs, char **args)
+{
+	struct addrspace *as, *oldas;
+	struct vmstats before, after;
+	volatile int *page;
+	unsigned slow, fast, i;
+	vaddr_t base;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting TLB refill fast path benchmark...\n");
+
+	as = as_create();
+	if (as == NULL) {
+		panic("vm14: out of memory\n");
+	}
+	/* the small regions go first, above the big one */
+	base = FAKE_VBASE + FASTPAGES * PAGE_SIZE + PAGE_SIZE;
+	for (i=0; i<FASTREGIONS; i++) {
+		if (as_define_region(as, base + 2 * i * PAGE_SIZE, PAGE_SIZE,
+				     1, 1, 0)) {
+			panic("vm14: out of memory\n");
+		}
+	}
+	if (as_define_region(as, FAKE_VBASE, FASTPAGES * PAGE_SIZE,
+			     1, 1, 0)) {
+		panic("vm14: out of memory\n");
+	}
+
+	oldas = proc_setas(as);
+	as_activate();
+	for (i=0; i<FASTPAGES; i++) {
+		page = (volatile int *)(FAKE_VBASE + i * PAGE_SIZE);
+		*page = i;
+	}
+
+	vmstats_total(&before);
+	slow = fastrun(false);
+	fast = fastrun(true);
+	vmstats_total(&after);
+
+	proc_setas(oldas);
+	as_activate();
+	as_destroy(as);
+
+	if (after.vs_fastpath - before.vs_fastpath < FASTROUNDS * FASTPAGES) {
+		panic("vm14: only %u of %u refills took the fast path\n",
+		      after.vs_fastpath - before.vs_fastpath,
+		      FASTROUNDS * FASTPAGES);
+	}
+	kprintf("vm14: %u regions, refill %u ns with region walk, "
+		"%u ns without\n", FASTREGIONS + 1,
+		slow * 1000 / (FASTROUNDS * FASTPAGES),
+		fast * 1000 / (FASTROUNDS * FASTPAGES));
+	kprintf("TLB refill fast path benchmark done\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// vm15
+
+/*
+ * Software TLB hit rate and invalidation.
+ *
+ * STLBPAGES resident pages, more than the hardware TLB holds, are
+ * touched STLBROUNDS times after a TLB flush with the software TLB off
+ * and on, and the refill time and hit rate are printed. Then one page
+ * is unmapped and mapped again to another frame while its old
+ * translation is in the software TLB: the next touch has to see the
+ * new frame.
+ */
+
+#define STLBPAGES   256
+#define STLBROUNDS  20
+#define STLBMAGIC   0x57b1
+
+static
+unsigned
+stlbrun(bool on)
+{
+	struct timespec before, after;
+	volatile int *page;
+	unsigned i, round;
+	int spl;
+
+	vm_set_stlb(on);
+	vm_set_tlb_prefetch(0);
+	gettime(&before);
+	for (round=0; round<STLBROUNDS; round++) {
+		spl = splhigh();
+		vm_tlb_flush();
+		splx(spl);
+		for (i=0; i<STLBPAGES; i++) {
+			page = (volatile int *)(FAKE_VBASE + i * PAGE_SIZE);
+			(void)*page;
+		}
+	}
+	gettime(&after);
+	vm_set_stlb(true);
+	vm_set_tlb_prefetch(TLB_PREFETCH_MAX);
+
+	return elapsed_us(&before, &after);
+}
+
+/* map the first page to frame PA instead, and touch it */
+static
+int
+stlbremap(struct addrspace *as, paddr_t pa)
+{
+	int spl;
+
+	hpt_delete(as, FAKE_VBASE);
+	if (hpt_insert(as, FAKE_VBASE, pa, DEFAULT_CACHE_BIT,
+		       1, DEFAULT_VALID_BIT) == NULL) {
+		panic("vm15: out of page table entries\n");
+	}
+	spl = splhigh();
+	vm_tlb_flush();
+	splx(spl);
+	return *(volatile int *)FAKE_VBASE;
+}
+
+int
+stlbtest(int nargs, char **args)
+{
+	struct addrspace *as, *oldas;
+	struct vmstats before, after;
+	struct hpt_entry *entry;
+	volatile int *page;
+	unsigned off, on, i, hits, invals;
+	paddr_t oldpa;
+	vaddr_t va;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting software TLB test...\n");
+
+	as = as_create();
+	if (as == NULL) {
+		panic("vm15: out of memory\n");
+	}
+	if (as_define_region(as, FAKE_VBASE, STLBPAGES * PAGE_SIZE,
+			     1, 1, 0)) {
+		panic("vm15: out of memory\n");
+	}
+	oldas = proc_setas(as);
+	as_activate();
+	for (i=0; i<STLBPAGES; i++) {
+		page = (volatile int *)(FAKE_VBASE + i * PAGE_SIZE);
+		*page = i;
+	}
+
+	off = stlbrun(false);
+	vmstats_total(&before);
+	on = stlbrun(true);
+	vmstats_total(&after);
+
+	/* everything but the first round should hit */
+	hits = after.vs_stlb_hits - before.vs_stlb_hits;
+	if (hits < (STLBROUNDS - 1) * STLBPAGES / 2) {
+		panic("vm15: only %u of %u refills hit the software TLB\n",
+		      hits, STLBROUNDS * STLBPAGES);
+	}
+	kprintf("vm15: %u pages, refill %u ns from the HPT, %u ns with the "
+		"software TLB, %u%% hits\n", STLBPAGES,
+		off * 1000 / (STLBROUNDS * STLBPAGES),
+		on * 1000 / (STLBROUNDS * STLBPAGES),
+		hits * 100 / (STLBROUNDS * STLBPAGES));
+
+	/* the first page's translation is in the software TLB now */
+	entry = hpt_lookup(as, FAKE_VBASE);
+	KASSERT(entry != NULL);
+	oldpa = entry->PFN & PAGE_FRAME;
+
+	va = alloc_kpages(1);
+	if (va == 0) {
+		panic("vm15: out of memory\n");
+	}
+	*(int *)va = STLBMAGIC;
+
+	vmstats_total(&before);
+	if (stlbremap(as, KVADDR_TO_PADDR(va)) != STLBMAGIC) {
+		panic("vm15: stale translation after unmap\n");
+	}
+	if (stlbremap(as, oldpa) != 0) {
+		panic("vm15: stale translation after unmap\n");
+	}
+	vmstats_total(&after);
+	invals = after.vs_stlb_invals - before.vs_stlb_invals;
+	free_kpages(va);
+
+	proc_setas(oldas);
+	as_activate();
+	as_destroy(as);
+
+	kprintf("vm15: %u software TLB slots invalidated by the remaps\n",
+		invals);
+	vmstats_print();
+	kprintf("Software TLB test done\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// vm16
+
+/*
+ * Selective TLB invalidation.
+ *
+ * With interrupts off, so nothing else writes the TLB meanwhile: one
+ * page is dropped with vm_tlb_invalidate and must be gone while the
+ * other pages that were there stay; then a range longer than the TLB
+ * (the one-pass path) is dropped the same way. Last, as_complete_load
+ * turns a region that was loaded writeable read-only, and must take
+ * its pages out of this cpu's TLB without flushing it or changing the
+ * address space's ASID.
+ */
+
+#define TINVALPAGES  16
+#define TINVALBIG    (NUM_TLB * 2)
+#define TINVALSMALL  FAKE_VBASE
+#define TINVALRANGE  (FAKE_VBASE + TINVALPAGES * PAGE_SIZE)
+#define TINVALTEXT   (TINVALRANGE + TINVALBIG * PAGE_SIZE)
+
+/* touch NPAGES pages from BASE, so (most of) them are in the TLB */
+static
+void
+tinvaltouch(vaddr_t base, unsigned npages)
+{
+	unsigned i;
+
+	for (i=0; i<npages; i++) {
+		(void)*(volatile int *)(base + i * PAGE_SIZE);
+	}
+}
+
+/* which of the small region's pages are in the TLB, as a bit mask */
+static
+uint32_t
+tinvalpresent(struct addrspace *as)
+{
+	uint32_t mask = 0;
+	unsigned i;
+
+	for (i=0; i<TINVALPAGES; i++) {
+		if (vm_tlb_probe(as, TINVALSMALL + i * PAGE_SIZE)) {
+			mask |= 1 << i;
+		}
+	}
+	return mask;
+}
+
+int
+tlbinvaltest(int nargs, char **args)
+{
+	struct addrspace *as, *oldas;
+	struct cpu *c;
+	unsigned flushes, invals;
+	uint32_t present, asid;
+	unsigned i;
+	int spl;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting selective TLB invalidation test...\n");
+
+	as = as_create();
+	if (as == NULL) {
+		panic("vm16: out of memory\n");
+	}
+	if (as_define_region(as, TINVALSMALL, TINVALPAGES * PAGE_SIZE,
+			     1, 1, 0) ||
+	    as_define_region(as, TINVALRANGE, TINVALBIG * PAGE_SIZE,
+			     1, 1, 0) ||
+	    as_define_region(as, TINVALTEXT, PAGE_SIZE, 1, 0, 1)) {
+		panic("vm16: out of memory\n");
+	}
+	oldas = proc_setas(as);
+	as_activate();
+	as_prepare_load(as);
+	for (i=0; i<TINVALPAGES + TINVALBIG + 1; i++) {
+		*(volatile int *)(FAKE_VBASE + i * PAGE_SIZE) = i;
+	}
+
+	spl = splhigh();
+	flushes = curcpu->c_vmstats.vs_tlb_flushes;
+	invals = curcpu->c_vmstats.vs_tlb_invals;
+
+	/* one page */
+	tinvaltouch(TINVALSMALL, TINVALPAGES);
+	tinvaltouch(TINVALSMALL + 3 * PAGE_SIZE, 1);
+	present = tinvalpresent(as);
+	if (!(present & (1 << 3))) {
+		panic("vm16: page just touched is not in the TLB\n");
+	}
+	vm_tlb_invalidate(as, TINVALSMALL + 3 * PAGE_SIZE, 1);
+	if (tinvalpresent(as) != (present & ~(1 << 3))) {
+		panic("vm16: invalidating one page changed others\n");
+	}
+
+	/* a range longer than the TLB */
+	tinvaltouch(TINVALSMALL, TINVALPAGES);
+	tinvaltouch(TINVALRANGE, TINVALBIG);
+	present = tinvalpresent(as);
+	vm_tlb_invalidate(as, TINVALRANGE, TINVALBIG);
+	for (i=0; i<TINVALBIG; i++) {
+		if (vm_tlb_probe(as, TINVALRANGE + i * PAGE_SIZE)) {
+			panic("vm16: page %u of the range still in the TLB\n",
+			      i);
+		}
+	}
+	if (tinvalpresent(as) != present) {
+		panic("vm16: invalidating a range changed other pages\n");
+	}
+
+	/*
+	 * as_complete_load making the text region read-only. It waits for
+	 * the other cpus to drop the page, so it runs with interrupts on;
+	 * the counters are those of the cpu we started on.
+	 */
+	tinvaltouch(TINVALTEXT, 1);
+	c = curcpu;
+	asid = as->asid[c->c_number];
+	splx(spl);
+	as_complete_load(as);
+	spl = splhigh();
+	if (vm_tlb_probe(as, TINVALTEXT)) {
+		panic("vm16: writeable text page left in the TLB\n");
+	}
+	if (as->asid[c->c_number] != asid) {
+		panic("vm16: as_complete_load changed the ASID\n");
+	}
+	if (c->c_vmstats.vs_tlb_flushes != flushes) {
+		panic("vm16: the TLB was flushed\n");
+	}
+	invals = c->c_vmstats.vs_tlb_invals - invals;
+
+	splx(spl);
+
+	if (*(volatile int *)TINVALTEXT != TINVALPAGES + TINVALBIG) {
+		panic("vm16: text page lost its contents\n");
+	}
+
+	proc_setas(oldas);
+	as_activate();
+	as_destroy(as);
+
+	kprintf("vm16: %u TLB entries invalidated one by one, no flushes\n",
+		invals);
+	kprintf("Selective TLB invalidation test done\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// vm17
+
+/*
+ * TLB shootdown stress.
+ *
+ * SHOOTREADERS threads share an address space of SHOOTPAGES pages and
+ * read them round and round, each page holding its own number in the
+ * top half. Meanwhile this thread moves page after page to a new frame
+ * with hpt_remap, shoots the old translation down and waits for it,
+ * then fills the old frame with SHOOTPOISON and frees it. A reader
+ * that still reaches an old frame through some cpu's TLB reads the
+ * poison. Readers that land on other cpus turn into shootdown targets;
+ * with one cpu the test still runs, but sends none.
+ */
+
+#define SHOOTPAGES   16
+#define SHOOTREADERS 4
+#define SHOOTROUNDS  2000
+#define SHOOTPOISON  0xdeadbeef
+
+static struct semaphore *shoot_done;
+static volatile bool shoot_stop;
+
+static
+void
+shootreader(void *junk, unsigned long num)
+{
+	uint32_t v;
+	unsigned i;
+
+	(void)junk;
+
+	while (!shoot_stop) {
+		for (i=0; i<SHOOTPAGES; i++) {
+			v = *(volatile uint32_t *)(FAKE_VBASE + i * PAGE_SIZE);
+			if (v == SHOOTPOISON) {
+				panic("vm17: reader %lu read a freed frame "
+				      "through a stale TLB entry\n", num);
+			}
+			if (v >> 16 != i) {
+				panic("vm17: reader %lu found 0x%x in page %u\n",
+				      num, v, i);
+			}
+		}
+	}
+	V(shoot_done);
+}
+
+int
+shootstress(int nargs, char **args)
+{
+	struct addrspace *as, *oldas;
+	struct vmstats before, after;
+	struct timespec start, end;
+	paddr_t oldpa, newpa;
+	vaddr_t va, vpn;
+	unsigned i, us;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting TLB shootdown stress test...\n");
+
+	shoot_done = sem_create("vm17", 0);
+	as = as_create();
+	if (shoot_done == NULL || as == NULL) {
+		panic("vm17: out of memory\n");
+	}
+	if (as_define_region(as, FAKE_VBASE, SHOOTPAGES * PAGE_SIZE,
+			     1, 1, 0)) {
+		panic("vm17: out of memory\n");
+	}
+	oldas = proc_setas(as);
+	as_activate();
+	for (i=0; i<SHOOTPAGES; i++) {
+		*(volatile uint32_t *)(FAKE_VBASE + i * PAGE_SIZE) = i << 16;
+	}
+
+	shoot_stop = false;
+	for (i=0; i<SHOOTREADERS; i++) {
+		result = thread_fork("shootreader", NULL, shootreader, NULL, i);
+		if (result) {
+			panic("vm17: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	vmstats_total(&before);
+	gettime(&start);
+	for (i=0; i<SHOOTROUNDS; i++) {
+		vpn = FAKE_VBASE + (i % SHOOTPAGES) * PAGE_SIZE;
+
+		va = alloc_kpages_flags(1, AKP_USER);
+		if (va == 0) {
+			panic("vm17: out of memory\n");
+		}
+		*(uint32_t *)va = ((i % SHOOTPAGES) << 16) | (i & 0xffff);
+		newpa = KVADDR_TO_PADDR(va);
+		result = frame_rmap_add(newpa, as, vpn);
+		KASSERT(result == 0);
+
+		oldpa = 0;
+		if (hpt_remap(as, vpn, newpa, 1, &oldpa)) {
+			panic("vm17: page 0x%x not mapped\n", vpn);
+		}
+		vm_tlb_shootdown(as, vpn, 1, true);
+
+		*(uint32_t *)PADDR_TO_KVADDR(oldpa) = SHOOTPOISON;
+		frame_rmap_remove(oldpa, as, vpn);
+		free_kpages(PADDR_TO_KVADDR(oldpa));
+
+		/* let the readers run on this cpu too */
+		if (i % SHOOTPAGES == 0) {
+			thread_yield();
+		}
+	}
+	gettime(&end);
+	vmstats_total(&after);
+
+	shoot_stop = true;
+	for (i=0; i<SHOOTREADERS; i++) {
+		P(shoot_done);
+	}
+
+	proc_setas(oldas);
+	as_activate();
+	as_destroy(as);
+	sem_destroy(shoot_done);
+
+	us = elapsed_us(&start, &end);
+	if (us == 0) {
+		us = 1;
+	}
+	kprintf("vm17: %u remaps in %u ms, %u shootdowns sent "
+		"(%u per second), %u coalesced into flushes\n",
+		SHOOTROUNDS, us / 1000,
+		after.vs_shootdowns - before.vs_shootdowns,
+		(after.vs_shootdowns - before.vs_shootdowns) * 1000 /
+		(us / 1000 + 1),
+		after.vs_shootdown_flushes - before.vs_shootdown_flushes);
+	kprintf("TLB shootdown stress test done\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// vm18
+
+/*
+ * TLB replacement policies.
+ *
+ * A stand-in for a matmult-style loop: an address space with a code
+ * region of POLCODE pages, a stack and POLDATA data pages, more than
+ * the TLB holds. Each step reads the next data page, then every code
+ * page and the top stack page, as a loop body would. This runs with
+ * interrupts off, so all refills are this loop's, under each policy
+ * with and without the wired slots. With the wired slots on, code and
+ * stack must stay in the TLB after the first round: every refill is a
+ * data page.
+ */
+
+#define POLCODE    2
+#define POLDATA    (NUM_TLB + NUM_TLB / 2)
+#define POLROUNDS  20
+#define POLCODEBASE (FAKE_VBASE + POLDATA * PAGE_SIZE)
+
+static
+unsigned
+polrun(int policy, bool wired, unsigned *rearms)
+{
+	struct vmstats *vs;
+	unsigned refills, round, i, j;
+	int spl;
+
+	vm_set_tlb_policy(policy);
+	vm_set_tlb_wired(wired);
+	vm_set_tlb_prefetch(0);
+
+	spl = splhigh();
+	vm_tlb_flush();
+	vs = &curcpu->c_vmstats;
+	refills = vs->vs_refills;
+	*rearms = vs->vs_tlb_rearms;
+	for (round=0; round<POLROUNDS; round++) {
+		for (i=0; i<POLDATA; i++) {
+			if (*(volatile unsigned *)(FAKE_VBASE + i * PAGE_SIZE)
+			    != i) {
+				panic("vm18: data page %u lost\n", i);
+			}
+			for (j=0; j<POLCODE; j++) {
+				(void)*(volatile int *)(POLCODEBASE +
+							j * PAGE_SIZE);
+			}
+			(void)*(volatile int *)(USERSTACK - PAGE_SIZE);
+		}
+	}
+	refills = vs->vs_refills - refills;
+	*rearms = vs->vs_tlb_rearms - *rearms;
+	splx(spl);
+
+	vm_set_tlb_policy(TLB_POLICY_RANDOM);
+	vm_set_tlb_wired(true);
+	vm_set_tlb_prefetch(TLB_PREFETCH_MAX);
+	return refills;
+}
+
+int
+tlbpolicytest(int nargs, char **args)
+{
+	static const char *names[TLB_NPOLICIES] = { "random", "rr", "clock" };
+	struct addrspace *as, *oldas;
+	unsigned refills, rearms, i;
+	vaddr_t stackptr;
+	int policy, wired;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting TLB replacement policy test...\n");
+
+	as = as_create();
+	if (as == NULL) {
+		panic("vm18: out of memory\n");
+	}
+	if (as_define_region(as, FAKE_VBASE, POLDATA * PAGE_SIZE, 1, 1, 0) ||
+	    as_define_region(as, POLCODEBASE, POLCODE * PAGE_SIZE, 1, 0, 1) ||
+	    as_define_stack(as, &stackptr)) {
+		panic("vm18: out of memory\n");
+	}
+	oldas = proc_setas(as);
+	as_activate();
+	as_prepare_load(as);
+	for (i=0; i<POLDATA + POLCODE; i++) {
+		*(volatile unsigned *)(FAKE_VBASE + i * PAGE_SIZE) = i;
+	}
+	as_complete_load(as);
+	*(volatile int *)(USERSTACK - PAGE_SIZE) = 0;
+
+	for (policy=0; policy<TLB_NPOLICIES; policy++) {
+		for (wired=0; wired<2; wired++) {
+			refills = polrun(policy, wired, &rearms);
+			kprintf("vm18: %-6s %-7s %6u refills, %6u clock "
+				"reference faults\n", names[policy],
+				wired ? "wired" : "nowired", refills, rearms);
+			/* only the first round may refill code and stack */
+			if (wired && refills > POLROUNDS * POLDATA +
+			    POLCODE + 1) {
+				panic("vm18: code or stack pushed out of the "
+				      "wired slots\n");
+			}
+		}
+	}
+
+	proc_setas(oldas);
+	as_activate();
+	as_destroy(as);
+
+	kprintf("TLB replacement policy test done\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// vm19
+
+/*
+ * TLB prefetch.
+ *
+ * PFPAGES resident pages, more than the TLB holds, are read in order
+ * after a TLB flush, as a program streaming through a buffer would,
+ * with prefetch off and on; with it on there must be far fewer
+ * refills, and every page must still read right. Then they are written
+ * in order through the preloaded translations, and read back. Last
+ * they are read PFSTRIDE pages apart, further than the window reaches,
+ * which must preload next to nothing. All with interrupts off, so the
+ * refills are this test's.
+ */
+
+#define PFPAGES   256
+#define PFSTRIDE  (TLB_PREFETCH_MAX * 2)
+#define PFMAGIC   0x9f000000
+
+/* read the pages STRIDE apart after a flush; returns the refills */
+static
+unsigned
+pfread(unsigned stride, unsigned magic, unsigned *prefetched)
+{
+	struct vmstats *vs = &curcpu->c_vmstats;
+	unsigned refills, i;
+
+	vm_tlb_flush();
+	refills = vs->vs_refills;
+	*prefetched = vs->vs_tlb_prefetched;
+	for (i=0; i<PFPAGES; i+=stride) {
+		if (*(volatile unsigned *)(FAKE_VBASE + i * PAGE_SIZE)
+		    != (i | magic)) {
+			panic("vm19: page %u reads wrong\n", i);
+		}
+	}
+	*prefetched = vs->vs_tlb_prefetched - *prefetched;
+	return vs->vs_refills - refills;
+}
+
+int
+prefetchtest(int nargs, char **args)
+{
+	struct addrspace *as, *oldas;
+	unsigned off, on, strided, prefetched, i;
+	int spl;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting TLB prefetch test...\n");
+
+	as = as_create();
+	if (as == NULL) {
+		panic("vm19: out of memory\n");
+	}
+	if (as_define_region(as, FAKE_VBASE, PFPAGES * PAGE_SIZE, 1, 1, 0)) {
+		panic("vm19: out of memory\n");
+	}
+	oldas = proc_setas(as);
+	as_activate();
+	for (i=0; i<PFPAGES; i++) {
+		*(volatile unsigned *)(FAKE_VBASE + i * PAGE_SIZE) = i;
+	}
+
+	spl = splhigh();
+
+	vm_set_tlb_prefetch(0);
+	off = pfread(1, 0, &prefetched);
+	vm_set_tlb_prefetch(TLB_PREFETCH_MAX);
+	on = pfread(1, 0, &prefetched);
+	if (on * 2 > off) {
+		panic("vm19: %u refills with prefetch, %u without\n", on, off);
+	}
+	kprintf("vm19: sequential: %u refills without prefetch, %u with "
+		"(%u preloaded)\n", off, on, prefetched);
+
+	/* writes go through preloaded translations too */
+	vm_tlb_flush();
+	for (i=0; i<PFPAGES; i++) {
+		*(volatile unsigned *)(FAKE_VBASE + i * PAGE_SIZE) =
+			i | PFMAGIC;
+	}
+	(void)pfread(1, PFMAGIC, &prefetched);
+
+	strided = pfread(PFSTRIDE, PFMAGIC, &prefetched);
+	/* the window left over from before closes within a few faults */
+	if (prefetched > TLB_PREFETCH_MAX * 2) {
+		panic("vm19: %u pages preloaded for %u strided reads\n",
+		      prefetched, strided);
+	}
+	kprintf("vm19: stride %u: %u refills, %u preloaded\n", PFSTRIDE,
+		strided, prefetched);
+
+	splx(spl);
+
+	proc_setas(oldas);
+	as_activate();
+	as_destroy(as);
+
+	kprintf("TLB prefetch test done\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// vm20
+
+/*
+ * Copy-on-write fork.
+ *
+ * An address space with COWPAGES resident pages is copied with
+ * as_copy, once copying every page and once sharing them, and both
+ * times are printed, as a stand-in for the fork of a big process. The
+ * shared copy must map every frame twice, read-only on both sides.
+ * Then the child writes the even pages and the parent the odd ones:
+ * each write copies the page, and neither side may see the other's
+ * writes. Once the child is gone the parent writes the even pages as
+ * well, which it is the last holder of by then, so they are written in
+ * place without a copy.
+ */
+
+#define COWPAGES   64
+#define COWCHILD   0x40000000
+#define COWPARENT  0x20000000
+
+static
+void
+cowexpect(unsigned i, unsigned expected)
+{
+	unsigned got = *(volatile unsigned *)(FAKE_VBASE + i * PAGE_SIZE);
+
+	if (got != expected) {
+		panic("vm20: page %u holds 0x%x, expected 0x%x\n", i, got,
+		      expected);
+	}
+}
+
+#if !OPT_IPT
+static
+void
+cowcheck(struct addrspace *parent, struct addrspace *child)
+{
+	struct hpt_entry *pe, *ce;
+	struct vmstats before, after;
+	vaddr_t va;
+	unsigned i;
+
+	for (i=0; i<COWPAGES; i++) {
+		va = FAKE_VBASE + i * PAGE_SIZE;
+		pe = hpt_lookup(parent, va);
+		ce = hpt_lookup(child, va);
+		KASSERT(pe != NULL && ce != NULL);
+		if ((pe->PFN & PAGE_FRAME) != (ce->PFN & PAGE_FRAME) ||
+		    ((pe->PFN | ce->PFN) & TLBLO_DIRTY)) {
+			panic("vm20: page %u not shared read-only\n", i);
+		}
+		rmapexpect(pe->PFN & PAGE_FRAME, 2, 2);
+	}
+
+	vmstats_total(&before);
+	proc_setas(child);
+	as_activate();
+	for (i=0; i<COWPAGES; i++) {
+		cowexpect(i, i);
+		if (i % 2 == 0) {
+			*(volatile unsigned *)(FAKE_VBASE + i * PAGE_SIZE) =
+				i | COWCHILD;
+		}
+	}
+	proc_setas(parent);
+	as_activate();
+	for (i=0; i<COWPAGES; i++) {
+		cowexpect(i, i);
+		if (i % 2 == 1) {
+			*(volatile unsigned *)(FAKE_VBASE + i * PAGE_SIZE) =
+				i | COWPARENT;
+		}
+	}
+	proc_setas(child);
+	as_activate();
+	for (i=0; i<COWPAGES; i++) {
+		cowexpect(i, i % 2 == 0 ? i | COWCHILD : i);
+	}
+	proc_setas(parent);
+	as_activate();
+	vmstats_total(&after);
+	if (after.vs_cow_copies - before.vs_cow_copies != COWPAGES) {
+		panic("vm20: %u pages copied on write, expected %u\n",
+		      after.vs_cow_copies - before.vs_cow_copies, COWPAGES);
+	}
+#if OPT_VMDEBUG
+	frame_table_check_as(parent);
+	frame_table_check_as(child);
+#endif
+
+	as_destroy(child);
+	vmstats_total(&before);
+	for (i=0; i<COWPAGES; i += 2) {
+		*(volatile unsigned *)(FAKE_VBASE + i * PAGE_SIZE) =
+			i | COWPARENT;
+	}
+	vmstats_total(&after);
+	if (after.vs_cow_reuses - before.vs_cow_reuses != COWPAGES / 2 ||
+	    after.vs_cow_copies != before.vs_cow_copies) {
+		panic("vm20: the last holder's writes copied pages\n");
+	}
+	for (i=0; i<COWPAGES; i++) {
+		cowexpect(i, i | COWPARENT);
+		pe = hpt_lookup(parent, FAKE_VBASE + i * PAGE_SIZE);
+		KASSERT(pe != NULL);
+		rmapexpect(pe->PFN & PAGE_FRAME, 1, 1);
+	}
+	kprintf("vm20: %u pages shared, copied on the first write on either "
+		"side\n", COWPAGES);
+}
+#endif
+
+int
+cowtest(int nargs, char **args)
+{
+	struct timespec before, after;
+	struct addrspace *as, *oldas, *copy;
+	unsigned eager, cow, i;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting copy-on-write fork test...\n");
+
+	as = as_create();
+	if (as == NULL ||
+	    as_define_region(as, FAKE_VBASE, COWPAGES * PAGE_SIZE, 1, 1, 0)) {
+		panic("vm20: out of memory\n");
+	}
+	oldas = proc_setas(as);
+	as_activate();
+	for (i=0; i<COWPAGES; i++) {
+		*(volatile unsigned *)(FAKE_VBASE + i * PAGE_SIZE) = i;
+	}
+
+	as_set_cow(false);
+	gettime(&before);
+	if (as_copy(as, &copy)) {
+		panic("vm20: out of memory\n");
+	}
+	gettime(&after);
+	as_set_cow(true);
+	eager = elapsed_us(&before, &after);
+	as_destroy(copy);
+
+	gettime(&before);
+	if (as_copy(as, &copy)) {
+		panic("vm20: out of memory\n");
+	}
+	gettime(&after);
+	cow = elapsed_us(&before, &after);
+	kprintf("vm20: as_copy of %u resident pages: %u us copying, %u us "
+		"sharing\n", COWPAGES, eager, cow);
+
+#if OPT_IPT
+	/* a frame has one translation, so as_copy copied them anyway */
+	as_destroy(copy);
+#else
+	cowcheck(as, copy);
+#endif
+
+	proc_setas(oldas);
+	as_activate();
+	as_destroy(as);
+
+	kprintf("Copy-on-write fork test done\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// vm21
+
+/*
+ * Reclaimed boot frames.
+ *
+ * Single kernel pages are taken until there are none left, so every
+ * free frame frame_table_reclaim_boot handed over is among them, then
+ * all are freed. A reclaimed frame is below the end of the boot
+ * frames, but belongs to the frame table now and has to go back to
+ * it; afterwards as many frames must be free as before.
+ */
+
+int
+bootfreetest(int nargs, char **args)
+{
+	vaddr_t head = 0, next, va;
+	unsigned npages = 0, nboot = 0, nreclaimed;
+	int bootend, nfree;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting reclaimed boot frame test...\n");
+
+	frame_table_boot_info(&nreclaimed, &bootend);
+	nfree = frame_table_free_count();
+	while ((va = alloc_kpages_flags(1, 0)) != 0) {
+		/* chain the pages through their first word */
+		*(vaddr_t *)va = head;
+		head = va;
+		npages++;
+		if ((int)(KVADDR_TO_PADDR(va) / PAGE_SIZE) < bootend) {
+			nboot++;
+		}
+	}
+	if (nreclaimed > 0 && nboot == 0) {
+		panic("vm21: none of the %u reclaimed frames handed out\n",
+		      nreclaimed);
+	}
+
+	while (head != 0) {
+		next = *(vaddr_t *)head;
+		free_kpages(head);
+		head = next;
+	}
+	/* the free count takes in magazines and the zeroed pool; allow
+	   for a few allocations by other threads meanwhile */
+	if (frame_table_free_count() + FT_MAGAZINE_SIZE < nfree) {
+		panic("vm21: %d frames free after, %d before\n",
+		      frame_table_free_count(), nfree);
+	}
+
+	kprintf("vm21: took and freed %u pages, %u of them reclaimed boot "
+		"frames (%u reclaimed)\n", npages, nboot, nreclaimed);
+	kprintf("Reclaimed boot frame test done\n");
+	return 0;
+}
@@ -33,6 +33,7 @@
 #include <spl.h>
 #include <spinlock.h>
 #include <current.h>
+#include <cpu.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
@@ -62,7 +63,20 @@ as_create(void)
          * Initialize as needed.
          */
         as->num_regions = 0;
+        as->rss = 0;
+        as->text_base = 0;
+        as->text_end = 0;
+        as->stack_base = 0;
         as->first_region = NULL;
+        // no ASID on any cpu yet
+        bzero(as->asid, sizeof(as->asid));
+        as->cpumask = 0;
+        spinlock_init(&as->cpumask_lock);
+
+        if(hpt_as_register(as)) {
+                kfree(as);
+                return NULL;
+        }
 
         return as;
 }
@@ -82,8 +96,24 @@ as_copy(struct addrspace *old, struct addrspace **ret)
          */
 
         newas->num_regions = old->num_regions;
-        // deep copy, need to copy physical frame and hpt entry as well
-        newas->first_region = copy_region(newas, old->first_region);
+        newas->text_base = old->text_base;
+        newas->text_end = old->text_end;
+        newas->stack_base = old->stack_base;
+        // the child shares the frames copy-on-write (copies them with
+        // OPT_IPT), and gets hpt entries of its own
+        newas->first_region = copy_region(old, newas, old->first_region);
+        hpt_rehash_step();
+        if(newas->first_region == NULL && old->first_region != NULL) {
+                // out of memory or page table entries; copy_region
+                // undid what it had done
+                as_destroy(newas);
+                return ENOMEM;
+        }
+
+#if OPT_VMDEBUG
+        frame_table_check_as(old);
+        frame_table_check_as(newas);
+#endif
 
         *ret = newas;
         return 0;
@@ -96,17 +126,27 @@ as_destroy(struct addrspace *as)
          * Clean up as needed.
          */
 
+#if OPT_VMDEBUG
+        frame_table_check_as(as);
+#endif
+
         // clean up all the regions, its physical frame and hpt entry
         destroy_all_region(as, as->first_region);
+        hpt_as_unregister(as);
+        hpt_rehash_step();
+
+#if OPT_VMDEBUG
+        frame_table_check();
+#endif
 
         // free data structure itself
+        spinlock_cleanup(&as->cpumask_lock);
         kfree(as);
 }
 
 void
 as_activate(void)
 {
-        /*flush TLB*/
         struct addrspace *as;
 
         as = proc_getas();
@@ -119,21 +159,42 @@ as_activate(void)
         }
 
         /*
-         * Write this.
+         * The TLB is not flushed here. Entries are tagged with the
+         * ASID of their address space, so switching only has to load
+         * this address space's ASID into EntryHi; what other address
+         * spaces left in the TLB no longer matches.
          */
 
         /* Disable interrupts on this CPU while frobbing the TLB. */
         int spl = splhigh();
-        int i;
-        // use TLBHI_INVALID(i) is enough, won't cause duplicated entry
-        // error, since it is used for flush
-        for (i=0; i<NUM_TLB; i++) {
-                // vaddr_t entryno = (vaddr_t)as;
-                // entryno = entryno & 0x8FFFF;
-                // entryno += i;
-                // tlb_write(TLBHI_INVALID(entryno), TLBLO_INVALID(), i);
-                tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+        struct cpu * c = curcpu;
+        KASSERT(c->c_number < VM_MAXCPUS);
+
+        uint32_t asid = as->asid[c->c_number];
+        if((asid >> ASID_BITS) != c->c_asid_gen) {
+                // no ASID on this cpu in the current generation
+                if(c->c_asid_next == NUM_ASIDS) {
+                        // out of ASIDs: every TLB entry may carry a
+                        // reused one, so drop them all and start over
+                        c->c_asid_gen++;
+                        c->c_asid_next = 1;
+                        vm_tlb_flush();
+                        VMSTAT_INC(vs_asid_rollovers);
+                }
+                asid = (c->c_asid_gen << ASID_BITS) | c->c_asid_next++;
+                as->asid[c->c_number] = asid;
+                VMSTAT_INC(vs_asid_allocs);
+                // set after the ASID, for vm_tlb_shootdown
+                spinlock_acquire(&as->cpumask_lock);
+                as->cpumask |= (uint32_t)1 << c->c_number;
+                spinlock_release(&as->cpumask_lock);
         }
+        c->c_asid = asid & ASID_MASK;
+        VMSTAT_INC(vs_activates);
+
+        // tlb_probe loads EntryHi and changes nothing else; the VPN
+        // part is an invalid address and is replaced on the next miss
+        tlb_probe(TLBHI_INVALID(0) | (c->c_asid << TLBHI_PID_SHIFT), 0);
 
         splx(spl);
 }
@@ -142,13 +203,10 @@ void
 as_deactivate(void)
 {
         /*
-         * Write this. For many designs it won't need to actually do
-         * anything. See proc.c for an explanation of why it (might)
-         * be needed.
+         * Nothing to do: the entries of the address space stay in the
+         * TLB under its ASID, which no other address space gets until
+         * this cpu rolls over to a new generation and flushes.
          */
-
-        // it do the same as as_activate();
-        as_activate();
 }
 
 /*
@@ -186,8 +244,21 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
         npages = sz / PAGE_SIZE;
 
         struct region * new_region = create_region(vaddr, npages, readable, writeable, executable);
+        if(new_region == NULL) {
+            return ENOMEM;
+        }
         add_region_to_as(as, new_region);
 
+        // code, as opposed to the stack, which is executable too
+        if(executable && !writeable) {
+            if(as->text_end == 0 || vaddr < as->text_base) {
+                as->text_base = vaddr;
+            }
+            if(vaddr + sz > as->text_end) {
+                as->text_end = vaddr + sz;
+            }
+        }
+
         // define a new region successfully.
         return 0;
 }
@@ -229,6 +300,14 @@ as_complete_load(struct addrspace *as)
                         // KASSERT(cur_region->is_writeable == 1);
                         cur_region->is_writeable = 0;
                         cur_region->prepare_load_recover_flag = false;
+                        // the pages loaded so far were mapped writeable,
+                        // and vm_fault trusts the entries
+                        region_clear_dirty(as, cur_region);
+                        // drop the writeable copies from every TLB that
+                        // may hold them, other cpus' ASIDs are theirs to
+                        // change
+                        vm_tlb_shootdown(as, cur_region->vbase,
+                            cur_region->npages, true);
                 } 
 
                 cur_region = cur_region->next_region;
@@ -249,6 +328,7 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 
         // KASSERT(as_define_stack_success == 0);
         if (as_define_stack_success == 0) {
+                as->stack_base = USERSTACK - STACK_PAGE_NUMS * PAGE_SIZE;
                 /* Initial user-level stack pointer */
                 *stackptr = USERSTACK;
 
@@ -268,11 +348,21 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 *   @param npages decribe page number
 *   @param the last three is the access parameter
 *   
-*   @return created new region
+*   @return created new region, NULL if out of memory
 */
 struct region * 
 create_region(vaddr_t vbase, size_t npages, int readable, int writeable, int executable) {
         struct region* new_region = (struct region*) kmalloc(sizeof(struct region));
+        if(new_region == NULL) {
+                return NULL;
+        }
+        // bitmap_create can't do zero bits
+        new_region->resident = bitmap_create(npages > 0 ? npages : 1);
+        if(new_region->resident == NULL) {
+                kfree(new_region);
+                return NULL;
+        }
+        new_region->nresident = 0;
         new_region->vbase = vbase;
         new_region->npages = npages;
         new_region->is_readable = readable;
@@ -303,52 +393,123 @@ add_region_to_as(struct addrspace* as, struct region* _region) {
         as->num_regions++;
 }
 
+/**
+*   Record that page VPN of the region of AS now has a frame and an HPT
+*   entry.
+*/
+void
+region_mark_resident(struct addrspace* as, struct region* _region, vaddr_t vpn) {
+        bitmap_mark(_region->resident, (vpn - _region->vbase) / PAGE_SIZE);
+        _region->nresident++;
+        as->rss++;
+}
+
+/**
+*   Clear the dirty bit of every resident page of a region, after it
+*   became read-only or before its frames are shared
+*/
+void
+region_clear_dirty(struct addrspace* as, struct region* _region) {
+        unsigned i = 0;
+
+        while(bitmap_nextset(_region->resident, i, &i) == 0) {
+                hpt_clear_dirty(as, _region->vbase + i * PAGE_SIZE);
+                i++;
+        }
+}
+
+// see as_set_cow
+static volatile bool as_cow = true;
+
+void
+as_set_cow(bool on) {
+        as_cow = on;
+}
+
 /* 
-*   Deep copy the regions along with the linked-list, copy the corresponding
-*   physical frame, and insert newly created frame to hash_page_table. And this
-*   is done in a recursive manner, since the underlying data structure is linked-list.
+*   Deep copy the regions along with the linked-list, and map each resident
+*   page into hash_page_table of the new address space. And this is done in
+*   a recursive manner, since the underlying data structure is linked-list.
+*   Only the pages in the resident bitmap are looked at, so the cost is
+*   proportional to the resident size, not the virtual size, and the new
+*   entries go in with hpt_insert_batch.
 *
+*   The pages are not copied: both sides map the same frame, with a
+*   reference each, and without the dirty bit, so the first write on
+*   either side faults and vm_fault copies it then. The old address
+*   space's writeable pages lose their dirty bit and its TLB entries for
+*   the region are shot down before the child maps any of them, so no
+*   write through a stale entry lands in a frame the child already sees.
+*   With OPT_IPT a frame can't be
+*   mapped twice, and with as_set_cow off, every page is copied now.
+*
+*   @param  struct addrspace *  The address space we copy from
 *   @param  struct addrspace *  The new address space contains the virtual addr space
 *                               Used in hpt_insert
 *   @param  struct region *     The original region we copy from
 *
-*   @return struct region *     The succesfully copied new region
+*   @return struct region *     The succesfully copied new region, NULL if
+*                               out of memory, with this and the later
+*                               regions of newas undone
 */
 struct region * 
-copy_region(struct addrspace * newas, struct region* old_region) {
+copy_region(struct addrspace * oldas, struct addrspace * newas, struct region* old_region) {
         if(old_region == NULL) {
                 return NULL;
         }
 
-        struct region * new_region = (struct region *)kmalloc(sizeof(struct region));
-        new_region->vbase = old_region->vbase;
-        new_region->npages = old_region->npages;
-        new_region->is_readable = old_region->is_readable;
-        new_region->is_writeable = old_region->is_writeable;
-        new_region->is_executable = old_region->is_executable;
+        struct region * new_region = create_region(old_region->vbase,
+                old_region->npages, old_region->is_readable,
+                old_region->is_writeable, old_region->is_executable);
+        if(new_region == NULL) {
+                return NULL;
+        }
         new_region->prepare_load_recover_flag = old_region->prepare_load_recover_flag;
 
-        /********* physical frame copy and hpt insertion ***********/ 
-        uint32_t i;
-        for(i = 0; i<old_region->npages; i++) {
-            // THINK ABOUT THAT npages == 3, vbase == 2000, page_size == 1000
-            // Need check in virtual addr space [2000-3000], [3000-4000], [4000-5000]
-            // copy all the possible physical frames.
-            struct hpt_entry * original_hpt_entry = hpt_lookup(proc_getas(),old_region->vbase+i*PAGE_SIZE);
+#if OPT_IPT
+        bool cow = false;
+#else
+        bool cow = as_cow;
+#endif
+
+        /********* physical frame share and hpt insertion ***********/ 
+        // Pages are shared (or copied) in batches of up to HPT_BATCH_MAX
+        // and each batch goes into hash_page_table with one
+        // hpt_insert_batch.
+        struct hpt_batch_item * items = NULL;
+        unsigned max = old_region->nresident < HPT_BATCH_MAX ?
+            old_region->nresident : HPT_BATCH_MAX;
+        if(max > 0) {
+            items = kmalloc(sizeof(struct hpt_batch_item) * max);
+            if(items == NULL) {
+                destroy_all_region(newas, new_region);
+                return NULL;
+            }
+        }
 
-            // If is null, means tha this virtual addr page do not have a physical frame mapping
-            // means it hasn't been used.
-            if(original_hpt_entry != NULL) {
-                void * temp = kmalloc(PAGE_SIZE);
-                vaddr_t alloc_vaddr = (vaddr_t) temp;
+        if(cow && old_region->is_writeable && old_region->nresident > 0) {
+            // the parent's side goes read-only first, everywhere; it is
+            // in as_copy, so not writing to the pages now
+            region_clear_dirty(oldas, old_region);
+            vm_tlb_shootdown(oldas, old_region->vbase, old_region->npages,
+                true);
+        }
 
-                // KASSERT(alloc_vaddr != 0);
-                if(alloc_vaddr == 0) {
-                    return NULL;
+        unsigned i = 0;
+        size_t done = 0;
+        bool failed = false;
+        while(done < old_region->nresident) {
+            unsigned n = 0, j;
+
+            while(n < max && done + n < old_region->nresident) {
+                if(bitmap_nextset(old_region->resident, i, &i) != 0) {
+                    break;
                 }
-                // get PFN of the allocated frame
-                paddr_t alloc_paddr = KVADDR_TO_PADDR(alloc_vaddr);
-                paddr_t alloc_paddr_PFN = alloc_paddr & PAGE_FRAME;
+                vaddr_t vpn = old_region->vbase + i * PAGE_SIZE;
+                i++;
+
+                struct hpt_entry * original_hpt_entry = hpt_lookup(oldas, vpn);
+                KASSERT(original_hpt_entry != NULL);
 
                 paddr_t original_physical_addr = original_hpt_entry->PFN;
                 // reset cache/dirty/valid bits
@@ -356,34 +517,91 @@ copy_region(struct addrspace * newas, struct region* old_region) {
                 original_physical_addr &= ~TLBLO_DIRTY;
                 original_physical_addr &= ~TLBLO_VALID;
 
+                if(cow) {
+                    // a reference and a mapping more for the frame
+                    frame_ref(original_physical_addr);
+                    if(frame_rmap_add(original_physical_addr, newas, vpn)) {
+                        frame_unref(original_physical_addr);
+                        failed = true;
+                        break;
+                    }
+                    items[n].VPN = vpn;
+                    items[n].PFN = original_physical_addr;
+                    n++;
+                    continue;
+                }
+
+                // overwritten by the copy below, no need to zero it
+                vaddr_t alloc_vaddr = alloc_kpages_flags(1, AKP_USER);
+
+                // KASSERT(alloc_vaddr != 0);
+                if(alloc_vaddr == 0) {
+                    failed = true;
+                    break;
+                }
+                // get PFN of the allocated frame
+                paddr_t alloc_paddr = KVADDR_TO_PADDR(alloc_vaddr);
+                paddr_t alloc_paddr_PFN = alloc_paddr & PAGE_FRAME;
+                int result = frame_rmap_add(alloc_paddr_PFN, newas, vpn);
+                KASSERT(result == 0);
+
                 // physical copy, use memmove instead of momcopy since
                 // this function will deal with overlapping
                 memmove((void *)PADDR_TO_KVADDR(alloc_paddr_PFN), 
                     (const void *)PADDR_TO_KVADDR(original_physical_addr), 
                     PAGE_SIZE);
 
-                // add to hpt_table
-                // according to previous example, 
-                // base could be 2000, 3000, 4000 in this case
-                // so we should use original_hpt_entry->VPN, instead of
-                // the vbase of original region.
-                hpt_insert(newas, 
-                    original_hpt_entry->VPN, 
-                    alloc_paddr_PFN, 
-                    DEFAULT_CACHE_BIT, 
-                    old_region->is_writeable, 
-                    DEFAULT_VALID_BIT);
+                items[n].VPN = vpn;
+                items[n].PFN = alloc_paddr_PFN;
+                n++;
             }
+            if(n == 0 && !failed) {
+                break;
+            }
+
+            // add to hpt_table, shared pages read-only
+            hpt_insert_batch(newas, items, n,
+                DEFAULT_CACHE_BIT, 
+                cow ? 0 : old_region->is_writeable, 
+                DEFAULT_VALID_BIT);
+            for(j = 0; j < n; j++) {
+                if(items[j].entry == NULL) {
+                    // drops the copy, or our reference to the shared one
+                    frame_rmap_remove(items[j].PFN, newas, items[j].VPN);
+                    frame_unref(items[j].PFN);
+                    failed = true;
+                } else {
+                    region_mark_resident(newas, new_region, items[j].VPN);
+                    if(cow) {
+                        VMSTAT_INC(vs_cow_shared);
+                    }
+                }
+            }
+            if(failed) {
+                break;
+            }
+            done += n;
+        }
+        kfree(items);
+
+        if(failed) {
+            destroy_all_region(newas, new_region);
+            return NULL;
         }
 
-        new_region->next_region = copy_region(newas, old_region->next_region);
+        new_region->next_region = copy_region(oldas, newas, old_region->next_region);
+        if(new_region->next_region == NULL && old_region->next_region != NULL) {
+            destroy_all_region(newas, new_region);
+            return NULL;
+        }
 
         return new_region;
 }
 
 /**
 *   Destroy physical frame, hpt_entry, and the bookkeeping data structure itself
-*   Same style as copy_region, in a recursive manner.
+*   Same style as copy_region, in a recursive manner, and likewise only
+*   visits the resident pages and uses hpt_delete_batch.
 *
 *   @param  struct addrspace *  The address space contains the virtual addr space
 *                               Used in hpt_lookup
@@ -391,36 +609,70 @@ copy_region(struct addrspace * newas, struct region* old_region) {
 */
 void 
 destroy_all_region(struct addrspace* as, struct region* _region) {
-        if(as->first_region == NULL) {
-                return;
-        }
-
         if(_region == NULL) {
                 return;
         }
 
         destroy_all_region(as, _region->next_region);
-        // free all the physical frame        
-        uint32_t i;
-        for(i = 0; i<_region->npages; i++) {
+        // free all the physical frame, the hpt entries go first in
+        // batches so the frames can't be handed out while still mapped
+        struct hpt_batch_item one;
+        struct hpt_batch_item * items = NULL;
+        unsigned max = _region->nresident < HPT_BATCH_MAX ?
+            _region->nresident : HPT_BATCH_MAX;
+        if(max > 0) {
+            items = kmalloc(sizeof(struct hpt_batch_item) * max);
+        }
+        if(items == NULL) {
+            // out of memory, go a page at a time
+            items = &one;
+            max = 1;
+        }
+
+        unsigned i = 0;
+        size_t done = 0;
+        while(done < _region->nresident) {
+            unsigned n = 0, j;
+
+            while(n < max && done + n < _region->nresident) {
+                if(bitmap_nextset(_region->resident, i, &i) != 0) {
+                    break;
+                }
+                items[n].VPN = _region->vbase + i * PAGE_SIZE;
+                i++;
+                n++;
+            }
+            if(n == 0) {
+                break;
+            }
+
             // use passed in as instead of proc_getas
-            struct hpt_entry * temp_hpt_entry = hpt_lookup(as, _region->vbase+i*PAGE_SIZE);
+            hpt_delete_batch(as, items, n);
 
-            if(temp_hpt_entry != NULL) {
-                paddr_t original_physical_addr = temp_hpt_entry->PFN;
+            for(j = 0; j < n; j++) {
+                paddr_t original_physical_addr = items[j].PFN;
+                if(original_physical_addr == 0) {
+                    continue;
+                }
                 // reset cache/dirty/valid bits
                 original_physical_addr &= ~TLBLO_NOCACHE;
                 original_physical_addr &= ~TLBLO_DIRTY;
                 original_physical_addr &= ~TLBLO_VALID;
-                // free physical frame
-                kfree((void *)PADDR_TO_KVADDR(original_physical_addr));
 
-                // delete corresponding entry in hash_page_table
-                hpt_delete(temp_hpt_entry->Pid, temp_hpt_entry->VPN);
+                // drop our mapping and reference, the frame goes when
+                // nobody else holds it
+                frame_rmap_remove(original_physical_addr, as, items[j].VPN);
+                frame_unref(original_physical_addr);
             }
+            done += n;
+        }
+        if(items != &one) {
+            kfree(items);
         }
 
         as->num_regions--;
+        as->rss -= _region->nresident;
+        bitmap_destroy(_region->resident);
         kfree(_region);
 }
 
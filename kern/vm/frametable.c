@@ -1,9 +1,14 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <spl.h>
 #include <thread.h>
+#include <current.h>
+#include <cpu.h>
+#include <wchan.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <kern/meminfo.h>
 
 /* Place your frametable data-structures here 
  * You probably also want to write a frametable initialisation
@@ -12,28 +17,143 @@
 
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 
+// Live allocations made with ram_stealmem before the frame table
+// existed, see FT_BOOT_ALLOCS. Protected by stealmem_lock.
+struct ft_boot_alloc {
+        paddr_t paddr;
+        unsigned npages;
+};
+
+static struct ft_boot_alloc ft_boot_allocs[FT_BOOT_ALLOCS];
+static unsigned ft_boot_nallocs;
+// more allocations than ft_boot_allocs holds, nothing is reclaimed
+static bool ft_boot_overflow;
+// first stolen address, the kernel image is below it; 0 until then
+static paddr_t ft_boot_first;
+// frames below this were stolen at boot (or are the kernel image)
+static int ft_boot_end;
+// set by frame_table_reclaim_boot; boot blocks freed after that go
+// straight to the buddy lists
+static bool ft_boot_reclaimed;
+// frames frame_table_reclaim_boot handed to the buddy lists
+static unsigned ft_boot_nreclaimed;
+
 // need a LOCK for frame table operation
 static struct spinlock frame_table_lock = SPINLOCK_INITIALIZER;
 
-struct frame_table_entry {
-        paddr_t corresponding_paddr;
-        struct frame_table_entry * next_free;
-        bool in_use_flag;
-};
-
-struct frame_table {
-        struct frame_table_entry * frame_table_arr;
-        // point to the lowest free_frame in frame_table_arr,
-        // used in finding the next free frame
-        struct frame_table_entry * lowest_free_frame_entry;
-        // before is the frames allocated to kernel and frame table itself
-        int free_ram_frame_start_index;
-        // total frame/physical page there will be
-        int page_number;
-};
+// refcounts and reverse maps of allocated frames; never held together
+// with frame_table_lock
+static struct spinlock frame_rmap_lock = SPINLOCK_INITIALIZER;
 
 struct frame_table * ft_table = 0;
 
+// Per-cpu magazines of free single frames, see FT_MAGAZINE_SIZE. A
+// magazine is only touched by its own cpu with interrupts off, so it
+// needs no lock; each one gets cache lines of its own. Frames in a
+// magazine are in use as far as the buddy lists are concerned, with
+// order FT_NO_ORDER so freeing one twice is caught.
+struct ft_magazine {
+        unsigned count;
+        struct frame_table_entry * frames[FT_MAGAZINE_SIZE];
+} __attribute__((aligned(64)));
+
+static struct ft_magazine ft_magazines[VM_MAXCPUS];
+static volatile unsigned ft_magazine_size = FT_MAGAZINE_SIZE;
+
+// Allocated frames per owner class (FT_OWNER_*). Each cpu counts what
+// it allocates and frees, with interrupts off, so a frame freed on
+// another cpu than it came from makes one count go negative; only the
+// sums mean anything. The boot-time frames are counted once, in
+// ft_boot_usage.
+struct ft_usage {
+        int frames[FT_NOWNERS];
+} __attribute__((aligned(64)));
+
+static struct ft_usage ft_usage[VM_MAXCPUS];
+static int ft_boot_usage[FT_NOWNERS];
+
+// Pool of pre-zeroed single frames linked through next_free, filled by
+// frame_zeroer (see FT_ZERO_TARGET). Protected by frame_table_lock.
+// Pool frames are allocated as far as the buddy lists know, with order
+// FT_NO_ORDER like magazine frames.
+static struct frame_table_entry * ft_zero_list = NULL;
+static volatile unsigned ft_zero_count = 0;
+// the zeroer sleeps here when the pool is full or memory is short
+static struct wchan * ft_zero_wchan;
+static volatile bool ft_zeroer_idle = false;
+// allocations only use the pool while this is set
+static volatile bool ft_zero_pool_on = true;
+
+// The reclaim thread sleeps on ft_reclaim_wchan until free memory goes
+// below FT_WMARK_LOW; throttled user allocations sleep on
+// ft_throttle_wchan until ft_reclaim_passes moves past the value they
+// read. The reclaimer keeps making passes while ft_throttle_waiters is
+// non-zero. All of these use frame_table_lock.
+static struct wchan * ft_reclaim_wchan;
+static struct wchan * ft_throttle_wchan;
+static volatile bool ft_reclaimer_idle = false;
+static unsigned ft_reclaim_passes = 0;
+static unsigned ft_throttle_waiters = 0;
+
+// the frame an entry describes is given by its index, so entries
+// don't carry their own physical address
+static inline paddr_t
+frame_paddr(struct frame_table_entry * fte) {
+        return (paddr_t)(fte - ft_table->frame_table_arr) * PAGE_SIZE;
+}
+
+// charge N frames (negative to credit them) to OWNER on this cpu
+static void
+usage_add(unsigned owner, int n) {
+        int spl = splhigh();
+        ft_usage[curcpu->c_number].frames[owner] += n;
+        splx(spl);
+}
+
+int
+frame_table_avail(void) {
+        return ft_table->free_frames + ft_zero_count;
+}
+
+// smallest order whose blocks hold npages frames
+static unsigned
+frame_order(unsigned npages) {
+        unsigned order = 0;
+        while ((1u << order) < npages) {
+                order++;
+        }
+        return order;
+}
+
+// put the free block headed by fte on the front of the list of ORDER
+static void
+free_list_push(unsigned order, struct frame_table_entry * fte) {
+        fte->order = order;
+        fte->prev_free = NULL;
+        fte->next_free = ft_table->free_lists[order];
+        if (fte->next_free != NULL) {
+                fte->next_free->prev_free = fte;
+        }
+        ft_table->free_lists[order] = fte;
+}
+
+// take the free block headed by fte off its list, it is no longer a
+// block head afterwards
+static void
+free_list_remove(struct frame_table_entry * fte) {
+        if (fte->prev_free != NULL) {
+                fte->prev_free->next_free = fte->next_free;
+        } else {
+                ft_table->free_lists[fte->order] = fte->next_free;
+        }
+        if (fte->next_free != NULL) {
+                fte->next_free->prev_free = fte->prev_free;
+        }
+        fte->next_free = NULL;
+        fte->prev_free = NULL;
+        fte->order = FT_NO_ORDER;
+}
+
 // put this init function in vm_bootstrap() 
 void frame_table_init() {
         paddr_t top_of_ram = ram_getsize();
@@ -49,30 +169,602 @@ void frame_table_init() {
         */
         paddr_t free_ram_start = ram_getfirstfree();
         ft_table_temp->free_ram_frame_start_index = free_ram_start / PAGE_SIZE;
-        ft_table_temp->lowest_free_frame_entry = &(ft_table_temp->frame_table_arr[ft_table_temp->free_ram_frame_start_index]);
+        ft_boot_end = ft_table_temp->free_ram_frame_start_index;
+        ft_table_temp->free_frames = ft_table_temp->page_number - ft_table_temp->free_ram_frame_start_index;
 
         /* and then initialize the frame table, then start use frame table based
         * allocator
         */
         int i;
+        unsigned k;
         for (i=0; i<ft_table_temp->page_number; i++ ) {
-                if (i < ft_table_temp->free_ram_frame_start_index) {
-                        ft_table_temp->frame_table_arr[i].in_use_flag = true;
-                        ft_table_temp->frame_table_arr[i].next_free = NULL;
-                } else {
-                        ft_table_temp->frame_table_arr[i].in_use_flag = false;
-                        if (i == ft_table_temp->page_number - 1) {
-                                ft_table_temp->frame_table_arr[i].next_free = NULL; 
-                        } else {
-                                ft_table_temp->frame_table_arr[i].next_free = &(ft_table_temp->frame_table_arr[i+1]);
-                        }
-                }
-                ft_table_temp->frame_table_arr[i].corresponding_paddr = i * PAGE_SIZE;
+                ft_table_temp->frame_table_arr[i].in_use_flag =
+                        i < ft_table_temp->free_ram_frame_start_index;
+                ft_table_temp->frame_table_arr[i].order = FT_NO_ORDER;
+                ft_table_temp->frame_table_arr[i].owner = FT_OWNER_KERNEL;
+                ft_table_temp->frame_table_arr[i].next_free = NULL;
+                ft_table_temp->frame_table_arr[i].prev_free = NULL;
+                ft_table_temp->frame_table_arr[i].refcount = 0;
+                ft_table_temp->frame_table_arr[i].rmap = 0;
+                ft_table_temp->frame_table_arr[i].rmap_more = NULL;
+#if OPT_IPT
+                ft_table_temp->frame_table_arr[i].ipt_entry.tag = 0;
+                ft_table_temp->frame_table_arr[i].ipt_entry.PFN = 0;
+                ft_table_temp->frame_table_arr[i].ipt_entry.next = HPT_NIL;
+#endif
         }
+        for (k=0; k<=FT_MAX_ORDER; k++) {
+                ft_table_temp->free_lists[k] = NULL;
+        }
+
+        // the boot frames hold the page table entries (in the frame
+        // table itself with OPT_IPT) and everything else taken so far
+#if OPT_IPT
+        size_t pgtable_bytes = sizeof(struct hpt_entry) * ft_table_temp->page_number;
+#else
+        size_t pgtable_bytes = sizeof(struct hpt_entry) *
+                HPT_ENTRIES_PER_FRAME * ft_table_temp->page_number;
+#endif
+        ft_boot_usage[FT_OWNER_PGTABLE] = DIVROUNDUP(pgtable_bytes, PAGE_SIZE);
+        ft_boot_usage[FT_OWNER_KERNEL] = ft_table_temp->free_ram_frame_start_index -
+                ft_boot_usage[FT_OWNER_PGTABLE];
 
+        // nothing calls kmalloc from here on, so the lists can be built
+        // in place
         ft_table = ft_table_temp;
+
+        // cut the free frames into the largest aligned blocks that fit
+        i = ft_table->free_ram_frame_start_index;
+        while (i < ft_table->page_number) {
+                k = FT_MAX_ORDER;
+                while ((i & ((1 << k) - 1)) != 0 ||
+                       i + (1 << k) > ft_table->page_number) {
+                        k--;
+                }
+                free_list_push(k, &(ft_table->frame_table_arr[i]));
+                i += 1 << k;
+        }
 }       
 
+/**
+*   Take a block of 2^order frames off the free lists, splitting a
+*   bigger block if there is none of that order. Caller holds
+*   frame_table_lock.
+*
+*   @return first frame of the block, NULL if there is no block big
+*   enough
+*/
+static struct frame_table_entry *
+buddy_alloc(unsigned order) {
+        // smallest free block that is big enough
+        unsigned k = order;
+        while (k <= FT_MAX_ORDER && ft_table->free_lists[k] == NULL) {
+                k++;
+        }
+        if (k > FT_MAX_ORDER) {
+                // means ram is fully filled, or too fragmented
+                return NULL;
+        }
+
+        struct frame_table_entry * fte = ft_table->free_lists[k];
+        KASSERT(fte->in_use_flag == false);
+        free_list_remove(fte);
+
+        // split it, giving back the upper half each time
+        while (k > order) {
+                k--;
+                free_list_push(k, fte + (1 << k));
+        }
+
+        unsigned i;
+        for (i=0; i < (1u << order); i++) {
+                fte[i].in_use_flag = true;
+        }
+        // free_kpages finds the size of the block here
+        fte->order = order;
+        ft_table->free_frames -= 1 << order;
+        return fte;
+}
+
+/**
+*   Give back an allocated block and merge it with its buddies. Caller
+*   holds frame_table_lock.
+*
+*   @param fte first frame of the block
+*/
+static void
+buddy_free(struct frame_table_entry * fte) {
+        unsigned order = fte->order;
+        unsigned i;
+        for (i=0; i < (1u << order); i++) {
+                fte[i].in_use_flag = false;
+        }
+        fte->order = FT_NO_ORDER;
+        ft_table->free_frames += 1 << order;
+
+        // merge with the buddy while it is a whole free block
+        int index = fte - ft_table->frame_table_arr;
+        while (order < FT_MAX_ORDER) {
+                int buddy = index ^ (1 << order);
+                if (buddy < ft_table->free_ram_frame_start_index ||
+                    buddy + (1 << order) > ft_table->page_number) {
+                        break;
+                }
+                struct frame_table_entry * bfte = &(ft_table->frame_table_arr[buddy]);
+                if (bfte->in_use_flag || bfte->order != order) {
+                        break;
+                }
+                free_list_remove(bfte);
+                index &= ~(1 << order);
+                order++;
+        }
+        free_list_push(order, &(ft_table->frame_table_arr[index]));
+}
+
+// move up to n single frames from the free lists into the magazine
+static void
+magazine_refill(struct ft_magazine * mag, unsigned n) {
+        struct frame_table_entry * fte;
+
+        spinlock_acquire(&frame_table_lock);
+        while (n-- > 0) {
+                fte = buddy_alloc(0);
+                if (fte == NULL) {
+                        break;
+                }
+                fte->order = FT_NO_ORDER;
+                mag->frames[mag->count++] = fte;
+        }
+        spinlock_release(&frame_table_lock);
+}
+
+// give the top n frames of the magazine back to the free lists
+static void
+magazine_drain(struct ft_magazine * mag, unsigned n) {
+        struct frame_table_entry * fte;
+
+        spinlock_acquire(&frame_table_lock);
+        while (n-- > 0) {
+                fte = mag->frames[--mag->count];
+                fte->order = 0;
+                buddy_free(fte);
+        }
+        spinlock_release(&frame_table_lock);
+}
+
+// The magazine size in use: none below FT_WMARK_LOW, so no cpu sits on
+// frames another one needs, and each cpu empties its magazine the next
+// time it allocates or frees.
+static unsigned
+magazine_size_now(void) {
+        return frame_table_avail() < FT_WMARK_LOW ? 0 : ft_magazine_size;
+}
+
+/**
+*   Take a single frame from this cpu's magazine, refilling it if it is
+*   empty
+*
+*   @return the frame, NULL if the magazines are off or there are no
+*   free frames left
+*/
+static struct frame_table_entry *
+magazine_alloc(void) {
+        struct frame_table_entry * fte = NULL;
+        // no interrupts, and so no migrating, while the magazine is used
+        int spl = splhigh();
+        struct ft_magazine * mag = &ft_magazines[curcpu->c_number];
+        unsigned size = magazine_size_now();
+
+        if (mag->count > size) {
+                // the size went down since this cpu last looked
+                magazine_drain(mag, mag->count - size);
+        }
+        if (size > 0) {
+                if (mag->count == 0) {
+                        magazine_refill(mag, size < FT_MAGAZINE_BATCH ?
+                            size : FT_MAGAZINE_BATCH);
+                }
+                if (mag->count > 0) {
+                        fte = mag->frames[--mag->count];
+                        fte->order = 0;
+                }
+        }
+
+        splx(spl);
+        return fte;
+}
+
+/**
+*   Put a single frame in this cpu's magazine, draining it first if it
+*   is full
+*
+*   @return true if the frame was taken, false if the magazines are off
+*/
+static bool
+magazine_free(struct frame_table_entry * fte) {
+        bool kept = false;
+        int spl = splhigh();
+        struct ft_magazine * mag = &ft_magazines[curcpu->c_number];
+        unsigned size = magazine_size_now();
+
+        if (mag->count >= size && mag->count > 0) {
+                // leave room for a batch of frees
+                unsigned keep = size > FT_MAGAZINE_BATCH ?
+                        size - FT_MAGAZINE_BATCH : 0;
+                magazine_drain(mag, mag->count - keep);
+        }
+        if (size > 0) {
+                fte->order = FT_NO_ORDER;
+                mag->frames[mag->count++] = fte;
+                kept = true;
+        }
+
+        splx(spl);
+        return kept;
+}
+
+void
+frame_table_set_magazine(unsigned size) {
+        KASSERT(size <= FT_MAGAZINE_SIZE);
+        // each cpu drains any extra frames the next time it allocates
+        // or frees
+        ft_magazine_size = size;
+}
+
+// wake the zeroer if it is asleep; caller holds frame_table_lock
+static void
+zeroer_wake(void) {
+        if (ft_zeroer_idle) {
+                ft_zeroer_idle = false;
+                wchan_wakeone(ft_zero_wchan, &frame_table_lock);
+        }
+}
+
+/**
+*   Take a frame from the pre-zeroed pool, waking the zeroer when the
+*   pool runs low
+*
+*   @param force take from the pool even if it is switched off
+*   @return the frame, NULL if the pool is empty
+*/
+static struct frame_table_entry *
+zero_pool_take(bool force) {
+        struct frame_table_entry * fte = NULL;
+
+        if (ft_zero_wchan == NULL) {
+                // no zeroer yet
+                return NULL;
+        }
+        if (!ft_zero_pool_on && !force) {
+                return NULL;
+        }
+        if (ft_zero_count == 0 && !ft_zeroer_idle) {
+                // unlocked peek, so an empty pool costs no lock while
+                // the zeroer is busy refilling it
+                return NULL;
+        }
+
+        spinlock_acquire(&frame_table_lock);
+        fte = ft_zero_list;
+        if (fte != NULL) {
+                ft_zero_list = fte->next_free;
+                fte->next_free = NULL;
+                fte->order = 0;
+                ft_zero_count--;
+        }
+        if (ft_zero_count < FT_ZERO_LOW) {
+                zeroer_wake();
+        }
+        spinlock_release(&frame_table_lock);
+        return fte;
+}
+
+/**
+*   Zeroing thread: keeps FT_ZERO_TARGET zeroed frames in the pool,
+*   yielding after each frame so it mostly runs when nothing else
+*   wants the cpu
+*/
+static void
+frame_zeroer(void * junk, unsigned long num) {
+        struct frame_table_entry * fte;
+
+        (void)junk;
+        (void)num;
+
+        while (true) {
+                spinlock_acquire(&frame_table_lock);
+                fte = NULL;
+                while (ft_zero_count >= FT_ZERO_TARGET ||
+                       ft_table->free_frames < FT_WMARK_HIGH ||
+                       (fte = buddy_alloc(0)) == NULL) {
+                        // pool full, or no memory to spare; an
+                        // allocation from the pool wakes us
+                        ft_zeroer_idle = true;
+                        wchan_sleep(ft_zero_wchan, &frame_table_lock);
+                }
+                fte->order = FT_NO_ORDER;
+                spinlock_release(&frame_table_lock);
+
+                bzero((void *)PADDR_TO_KVADDR(frame_paddr(fte)), PAGE_SIZE);
+                VMSTAT_INC(vs_zero_idle);
+
+                spinlock_acquire(&frame_table_lock);
+                fte->next_free = ft_zero_list;
+                ft_zero_list = fte;
+                ft_zero_count++;
+                spinlock_release(&frame_table_lock);
+
+                thread_yield();
+        }
+}
+
+void
+frame_table_set_zero_pool(bool on) {
+        ft_zero_pool_on = on;
+}
+
+unsigned
+frame_table_zeroed_count(void) {
+        return ft_zero_count;
+}
+
+void
+frame_table_start_zeroer(void) {
+        int result;
+
+        if (FT_ZERO_TARGET == 0) {
+                return;
+        }
+        ft_zero_wchan = wchan_create("ft_zero");
+        if (ft_zero_wchan == NULL) {
+                panic("frame_table_start_zeroer: out of memory\n");
+        }
+        result = thread_fork("zeroer", NULL, frame_zeroer, NULL, 0);
+        if (result) {
+                panic("frame_table_start_zeroer: thread_fork: %s\n",
+                    strerror(result));
+        }
+}
+
+/**
+*   Wake the reclaim thread if it is asleep; caller holds
+*   frame_table_lock
+*
+*   @return true if it was asleep
+*/
+static bool
+reclaimer_wake(void) {
+        if (ft_reclaim_wchan == NULL || !ft_reclaimer_idle) {
+                return false;
+        }
+        ft_reclaimer_idle = false;
+        wchan_wakeone(ft_reclaim_wchan, &frame_table_lock);
+        return true;
+}
+
+/**
+*   Reclaim thread, woken when free memory goes below FT_WMARK_LOW.
+*   There is no paging, so all it can give back are frames that are
+*   free already but held somewhere else. The magazines empty
+*   themselves below FT_WMARK_LOW (see magazine_size_now); the zeroed
+*   pool goes back to the buddy lists here, where it can merge into
+*   blocks, and the zeroer leaves it empty while memory is below
+*   FT_WMARK_HIGH. Then the page table gets a chance to shrink, and
+*   throttled user allocations look again. While any are waiting the
+*   thread goes straight into another pass instead of sleeping, so a
+*   waiter never depends on catching it idle.
+*/
+static void
+frame_reclaimer(void * junk, unsigned long num) {
+        struct frame_table_entry * fte;
+        unsigned n;
+
+        (void)junk;
+        (void)num;
+
+        while (true) {
+                spinlock_acquire(&frame_table_lock);
+                if (ft_throttle_waiters == 0) {
+                        ft_reclaimer_idle = true;
+                        while (ft_reclaimer_idle) {
+                                wchan_sleep(ft_reclaim_wchan,
+                                    &frame_table_lock);
+                        }
+                }
+
+                n = 0;
+                while ((fte = ft_zero_list) != NULL) {
+                        ft_zero_list = fte->next_free;
+                        fte->next_free = NULL;
+                        ft_zero_count--;
+                        fte->order = 0;
+                        buddy_free(fte);
+                        n++;
+                }
+                ft_reclaim_passes++;
+                wchan_wakeall(ft_throttle_wchan, &frame_table_lock);
+                spinlock_release(&frame_table_lock);
+
+                VMSTAT_INC(vs_reclaim_runs);
+                VMSTAT_ADD(vs_reclaimed, n);
+                hpt_rehash_step();
+                if (ft_throttle_waiters > 0) {
+                        // let the waiters run before the next pass
+                        thread_yield();
+                }
+        }
+}
+
+void
+frame_table_start_reclaim(void) {
+        int result;
+
+        ft_reclaim_wchan = wchan_create("ft_reclaim");
+        ft_throttle_wchan = wchan_create("ft_throttle");
+        if (ft_reclaim_wchan == NULL || ft_throttle_wchan == NULL) {
+                panic("frame_table_start_reclaim: out of memory\n");
+        }
+        result = thread_fork("reclaim", NULL, frame_reclaimer, NULL, 0);
+        if (result) {
+                panic("frame_table_start_reclaim: thread_fork: %s\n",
+                    strerror(result));
+        }
+}
+
+/**
+*   Hold back a user allocation while free memory is below FT_WMARK_MIN,
+*   the kernel's reserve, for up to FT_THROTTLE_TRIES reclaim passes
+*
+*   @return true if the allocation can go ahead
+*/
+static bool
+user_throttle(void) {
+        unsigned tries, seen;
+        bool ok;
+
+        if (frame_table_avail() >= FT_WMARK_MIN) {
+                return true;
+        }
+        VMSTAT_INC(vs_throttle);
+        if (ft_throttle_wchan == NULL || curthread->t_in_interrupt ||
+            curcpu->c_spinlocks > 0) {
+                // can't wait here
+                VMSTAT_INC(vs_throttle_fail);
+                return false;
+        }
+
+        spinlock_acquire(&frame_table_lock);
+        ft_throttle_waiters++;
+        for (tries=0; frame_table_avail() < FT_WMARK_MIN &&
+             tries < FT_THROTTLE_TRIES; tries++) {
+                seen = ft_reclaim_passes;
+                reclaimer_wake();
+                while (ft_reclaim_passes == seen) {
+                        wchan_sleep(ft_throttle_wchan, &frame_table_lock);
+                }
+        }
+        ft_throttle_waiters--;
+        ok = frame_table_avail() >= FT_WMARK_MIN;
+        spinlock_release(&frame_table_lock);
+
+        if (!ok) {
+                VMSTAT_INC(vs_throttle_fail);
+        }
+        return ok;
+}
+
+/**
+*   Hand boot frames FIRST .. FIRST+N-1 to the buddy lists, one frame at
+*   a time so they merge with whatever is free around them. Caller holds
+*   frame_table_lock.
+*/
+static void
+boot_release(int first, unsigned n) {
+        struct frame_table_entry * fte;
+        unsigned i;
+
+        for (i=0; i<n; i++) {
+                fte = &(ft_table->frame_table_arr[first + i]);
+                KASSERT(fte->in_use_flag && fte->order == FT_NO_ORDER);
+                fte->order = 0;
+                buddy_free(fte);
+        }
+        ft_boot_usage[FT_OWNER_KERNEL] -= n;
+}
+
+/**
+*   Free a block allocated before the frame table existed. Until
+*   frame_table_reclaim_boot has run this only forgets the block, and
+*   the hand-off reclaims its frames. Once it has, frames below
+*   ft_boot_end that no boot allocation covers belong to the frame
+*   table like any other, and may have been allocated from it since.
+*
+*   @return bool    false if PADDR is not a boot allocation, for
+*                   free_kpages to free the usual way
+*/
+static bool
+boot_free(paddr_t paddr) {
+        unsigned i, npages = 0;
+        bool reclaimed;
+
+        spinlock_acquire(&stealmem_lock);
+        for (i=0; i<ft_boot_nallocs; i++) {
+                if (ft_boot_allocs[i].paddr == paddr) {
+                        npages = ft_boot_allocs[i].npages;
+                        ft_boot_allocs[i] = ft_boot_allocs[--ft_boot_nallocs];
+                        break;
+                }
+        }
+        reclaimed = ft_boot_reclaimed;
+        spinlock_release(&stealmem_lock);
+
+        if (npages == 0) {
+                // a reclaimed frame; there is no hand-off with an
+                // overflowed ft_boot_allocs, so then it was stolen
+                // without being recorded and stays lost
+                KASSERT(reclaimed || ft_boot_overflow);
+                return !reclaimed;
+        }
+        if (reclaimed) {
+                spinlock_acquire(&frame_table_lock);
+                boot_release(paddr / PAGE_SIZE, npages);
+                spinlock_release(&frame_table_lock);
+        }
+        return true;
+}
+
+/**
+*   Boot-time allocator hand-off, at the end of vm_bootstrap: every
+*   frame stolen at boot that no live boot allocation covers goes to the
+*   buddy lists, and the frame table manages everything above the
+*   kernel image from then on.
+*/
+void
+frame_table_reclaim_boot(void) {
+        int first, i, nfreed = 0;
+        unsigned j;
+        bool live;
+
+        spinlock_acquire(&stealmem_lock);
+        if (ft_boot_overflow) {
+                spinlock_release(&stealmem_lock);
+                kprintf("vm: more than %d boot allocations, none "
+                    "reclaimed\n", FT_BOOT_ALLOCS);
+                return;
+        }
+        // with nothing stolen there is nothing to reclaim
+        first = ft_boot_first != 0 ? (int)(ft_boot_first / PAGE_SIZE) : ft_boot_end;
+
+        spinlock_acquire(&frame_table_lock);
+        ft_table->free_ram_frame_start_index = first;
+        for (i=first; i<ft_boot_end; i++) {
+                live = false;
+                for (j=0; j<ft_boot_nallocs && !live; j++) {
+                        live = i >= (int)(ft_boot_allocs[j].paddr / PAGE_SIZE) &&
+                            i < (int)(ft_boot_allocs[j].paddr / PAGE_SIZE +
+                            ft_boot_allocs[j].npages);
+                }
+                if (!live) {
+                        boot_release(i, 1);
+                        nfreed++;
+                }
+        }
+        spinlock_release(&frame_table_lock);
+
+        ft_boot_reclaimed = true;
+        ft_boot_nreclaimed = nfreed;
+        spinlock_release(&stealmem_lock);
+
+        kprintf("vm: reclaimed %d of %d boot frames, %u boot allocations "
+            "live\n", nfreed, ft_boot_end - first, ft_boot_nallocs);
+}
+
+void
+frame_table_boot_info(unsigned * nreclaimed, int * boot_end) {
+        *nreclaimed = ft_boot_nreclaimed;
+        *boot_end = ft_boot_end;
+}
+
 /* Note that this function returns a VIRTUAL address, not a physical 
  * address
  * WARNING: this function gets called very early, before
@@ -83,11 +775,12 @@ void frame_table_init() {
 
 vaddr_t alloc_kpages(unsigned int npages)
 {
-        /*
-         * IMPLEMENT ME.  You should replace this code with a proper
-         *                implementation.
-         */
-        // KASSERT(npages == 1);
+        return alloc_kpages_flags(npages, AKP_ZERO);
+}
+
+vaddr_t alloc_kpages_flags(unsigned int npages, int flags)
+{
+        KASSERT(npages > 0);
 
         if (ft_table == 0) {
                 /* user ram_stealmem */
@@ -95,6 +788,20 @@ vaddr_t alloc_kpages(unsigned int npages)
 
                 spinlock_acquire(&stealmem_lock);
                 addr = ram_stealmem(npages);
+                if (addr != 0) {
+                        // remember it, so it can be freed, or reclaimed
+                        // by frame_table_reclaim_boot if it is
+                        if (ft_boot_first == 0) {
+                                ft_boot_first = addr;
+                        }
+                        if (ft_boot_nallocs < FT_BOOT_ALLOCS) {
+                                ft_boot_allocs[ft_boot_nallocs].paddr = addr;
+                                ft_boot_allocs[ft_boot_nallocs].npages = npages;
+                                ft_boot_nallocs++;
+                        } else {
+                                ft_boot_overflow = true;
+                        }
+                }
                 spinlock_release(&stealmem_lock);
 
                 if(addr == 0)
@@ -103,30 +810,64 @@ vaddr_t alloc_kpages(unsigned int npages)
                 return PADDR_TO_KVADDR(addr);
         } else {
                 /* use my allocator as frame table is now initialized */
-                if (ft_table->lowest_free_frame_entry == NULL) {
-                        // means ram is fully filled
+                unsigned order = frame_order(npages);
+                if (order > FT_MAX_ORDER) {
                         return 0;
                 }
-
-                KASSERT(ft_table->lowest_free_frame_entry->in_use_flag == false);
-                if (ft_table->lowest_free_frame_entry->in_use_flag == true) {
-                        // try to allocate an already allocated frame
+                if ((flags & AKP_USER) && !user_throttle()) {
                         return 0;
                 }
 
-                spinlock_acquire(&frame_table_lock);
+                struct frame_table_entry * fte = NULL;
+                bool zeroed = false;
+                if (order == 0 && (flags & AKP_ZERO)) {
+                        fte = zero_pool_take(false);
+                        zeroed = fte != NULL;
+                }
+                if (fte == NULL && order == 0) {
+                        fte = magazine_alloc();
+                }
+                if (fte == NULL) {
+                        spinlock_acquire(&frame_table_lock);
+                        fte = buddy_alloc(order);
+                        spinlock_release(&frame_table_lock);
+                }
+                if (fte == NULL && order == 0 && !(flags & AKP_ZERO)) {
+                        // last frames left may be in the zeroed pool
+                        fte = zero_pool_take(true);
+                }
+                if (fte == NULL) {
+                        return 0;
+                }
 
-                ft_table->lowest_free_frame_entry->in_use_flag = true;
-                paddr_t ret_addr = ft_table->lowest_free_frame_entry->corresponding_paddr;
-                struct frame_table_entry * temp = ft_table->lowest_free_frame_entry;
-                ft_table->lowest_free_frame_entry = ft_table->lowest_free_frame_entry->next_free;
-                temp->next_free = NULL;
+                // unlocked peeks, the watermarks needn't be exact
+                if (frame_table_avail() < FT_WMARK_LOW && ft_reclaimer_idle) {
+                        spinlock_acquire(&frame_table_lock);
+                        if (reclaimer_wake()) {
+                                VMSTAT_INC(vs_wmark_low);
+                        }
+                        spinlock_release(&frame_table_lock);
+                }
+                if (frame_table_avail() < FT_WMARK_MIN) {
+                        // only the kernel gets this far below min
+                        VMSTAT_INC(vs_reserve);
+                }
 
-                // zero-out allocated physical frame
-                // this haven't been tested
-                bzero((void *)PADDR_TO_KVADDR(ret_addr), npages * PAGE_SIZE);
+                // the frames are ours alone from here
+                fte->refcount = 1;
+                fte->owner = (flags & AKP_USER) ? FT_OWNER_USER : FT_OWNER_KHEAP;
+                usage_add(fte->owner, 1 << order);
 
-                spinlock_release(&frame_table_lock);
+                paddr_t ret_addr = frame_paddr(fte);
+                if (zeroed) {
+                        VMSTAT_INC(vs_zero_pool);
+                } else if (flags & AKP_ZERO) {
+                        // zero-out allocated physical frames, outside the lock
+                        bzero((void *)PADDR_TO_KVADDR(ret_addr), PAGE_SIZE << order);
+                        VMSTAT_INC(vs_zero_sync);
+                } else {
+                        VMSTAT_INC(vs_zero_skip);
+                }
 
                 return PADDR_TO_KVADDR(ret_addr);
         }        
@@ -144,58 +885,397 @@ void free_kpages(vaddr_t addr)
 
         int frame_number = physical_addr >> 12;
 
-        KASSERT(frame_number >= ft_table->free_ram_frame_start_index);
-        if (frame_number < ft_table->free_ram_frame_start_index) {
-                // try to free parts allocated by bump allocator
+        if (ft_table == 0 || frame_number < ft_boot_end) {
+                // allocated by the bump allocator at boot, unless it is
+                // a reclaimed frame the frame table handed out since
+                if (boot_free(physical_addr)) {
+                        return;
+                }
+        }
+
+        struct frame_table_entry * fte = &(ft_table->frame_table_arr[frame_number]);
+
+        // must be the first frame of an allocated block; the block is
+        // the caller's, so nobody else changes these under us
+        KASSERT(fte->in_use_flag == true && fte->order != FT_NO_ORDER);
+        if (fte->in_use_flag == false || fte->order == FT_NO_ORDER) {
+                // try to free an already freed frame, or the middle of
+                // a block
                 return;
         }
 
-        KASSERT(ft_table->frame_table_arr[frame_number].in_use_flag == true);
-        if (ft_table->frame_table_arr[frame_number].in_use_flag == false) {
-                // try to free an already freed frame 
+        // still mapped or shared: frame_rmap_remove/frame_unref first
+        KASSERT(fte->refcount == 1);
+        KASSERT(fte->rmap == 0 && fte->rmap_more == NULL);
+        fte->refcount = 0;
+        usage_add(fte->owner, -(1 << fte->order));
+
+        if (fte->order == 0 && magazine_free(fte)) {
                 return;
         }
 
         spinlock_acquire(&frame_table_lock);
+        buddy_free(fte);
+        spinlock_release(&frame_table_lock);
+}
 
-        if (ft_table->lowest_free_frame_entry == NULL) {
-                ft_table->frame_table_arr[frame_number].in_use_flag = false;
-                ft_table->lowest_free_frame_entry = &(ft_table->frame_table_arr[frame_number]);
-                ft_table->frame_table_arr[frame_number].next_free = NULL;
-                return;
+// frame table entry of the allocated frame at PADDR
+static struct frame_table_entry *
+frame_entry(paddr_t paddr) {
+        int frame_number = paddr >> 12;
+
+        KASSERT(frame_number >= ft_table->free_ram_frame_start_index &&
+            frame_number < ft_table->page_number);
+        return &(ft_table->frame_table_arr[frame_number]);
+}
+
+void
+frame_ref(paddr_t paddr) {
+        struct frame_table_entry * fte = frame_entry(paddr);
+
+        spinlock_acquire(&frame_rmap_lock);
+        KASSERT(fte->in_use_flag && fte->refcount > 0);
+        KASSERT(fte->refcount < 0xffff);
+        fte->refcount++;
+        spinlock_release(&frame_rmap_lock);
+}
+
+bool
+frame_unref(paddr_t paddr) {
+        struct frame_table_entry * fte = frame_entry(paddr);
+        bool last;
+
+        spinlock_acquire(&frame_rmap_lock);
+        KASSERT(fte->in_use_flag && fte->refcount > 0);
+        last = fte->refcount == 1;
+        if (!last) {
+                fte->refcount--;
         }
+        spinlock_release(&frame_rmap_lock);
 
-        if (&(ft_table->frame_table_arr[frame_number]) < ft_table->lowest_free_frame_entry) {
-                // under the head
-                ft_table->frame_table_arr[frame_number].next_free = ft_table->lowest_free_frame_entry;
-                ft_table->lowest_free_frame_entry = &(ft_table->frame_table_arr[frame_number]);
-                ft_table->frame_table_arr[frame_number].in_use_flag = false;
+        if (last) {
+                // free_kpages takes the last reference
+                free_kpages(PADDR_TO_KVADDR(paddr & PAGE_FRAME));
+        }
+        return last;
+}
+
+unsigned
+frame_refcount(paddr_t paddr) {
+        return frame_entry(paddr)->refcount;
+}
+
+// number of mappings of a frame; caller holds frame_rmap_lock
+static unsigned
+frame_rmap_count_locked(struct frame_table_entry * fte) {
+        struct frame_rmap * node;
+        unsigned n = fte->rmap != 0;
+
+        for (node = fte->rmap_more; node != NULL; node = node->next) {
+                n++;
+        }
+        return n;
+}
+
+// whether TAG is among the mappings of a frame; caller holds
+// frame_rmap_lock
+static bool
+frame_rmap_has_locked(struct frame_table_entry * fte, uint32_t tag) {
+        struct frame_rmap * node;
+
+        if (fte->rmap == tag) {
+                return true;
+        }
+        for (node = fte->rmap_more; node != NULL; node = node->next) {
+                if (node->tag == tag) {
+                        return true;
+                }
+        }
+        return false;
+}
+
+/**
+*   Record that AS maps VPN to the frame at PADDR
+*
+*   @return 0, or ENOMEM if the frame is already mapped elsewhere and
+*   there is no memory for a chain entry
+*/
+int
+frame_rmap_add(paddr_t paddr, struct addrspace * as, vaddr_t VPN) {
+        struct frame_table_entry * fte = frame_entry(paddr);
+        uint32_t tag = HPT_TAG(as->hpt_id, VPN);
+        struct frame_rmap * node;
+
+        spinlock_acquire(&frame_rmap_lock);
+        KASSERT(fte->in_use_flag);
+        KASSERT(!frame_rmap_has_locked(fte, tag));
+        if (fte->rmap == 0) {
+                // the usual case, an unshared frame
+                fte->rmap = tag;
+                spinlock_release(&frame_rmap_lock);
+                return 0;
+        }
+        spinlock_release(&frame_rmap_lock);
+
+        // a shared frame needs a chain entry, allocated without the lock
+        node = kmalloc(sizeof(struct frame_rmap));
+        if (node == NULL) {
+                return ENOMEM;
+        }
+        node->tag = tag;
+
+        spinlock_acquire(&frame_rmap_lock);
+        if (fte->rmap == 0) {
+                // the other mapping went away meanwhile
+                fte->rmap = tag;
+        } else {
+                node->next = fte->rmap_more;
+                fte->rmap_more = node;
+                node = NULL;
+        }
+        spinlock_release(&frame_rmap_lock);
+
+        kfree(node);
+        return 0;
+}
+
+/**
+*   Forget that AS maps VPN to the frame at PADDR
+*/
+void
+frame_rmap_remove(paddr_t paddr, struct addrspace * as, vaddr_t VPN) {
+        struct frame_table_entry * fte = frame_entry(paddr);
+        uint32_t tag = HPT_TAG(as->hpt_id, VPN);
+        struct frame_rmap * node, ** link;
+
+        spinlock_acquire(&frame_rmap_lock);
+        if (fte->rmap == tag) {
+                // move a chained mapping, if any, into the entry
+                node = fte->rmap_more;
+                if (node != NULL) {
+                        fte->rmap = node->tag;
+                        fte->rmap_more = node->next;
+                } else {
+                        fte->rmap = 0;
+                }
         } else {
-                ft_table->frame_table_arr[frame_number].in_use_flag = false;
-                // trace back to the begining of the ft_table->frame_table_arr
-                int i = frame_number - 1;
-                for (; i>=ft_table->free_ram_frame_start_index; i--) {
-                        if (ft_table->frame_table_arr[i].in_use_flag == false) {
-                                ft_table->frame_table_arr[i].next_free = &(ft_table->frame_table_arr[frame_number]);
-                                break;
+                link = &(fte->rmap_more);
+                while (*link != NULL && (*link)->tag != tag) {
+                        link = &((*link)->next);
+                }
+                node = *link;
+                KASSERT(node != NULL);
+                if (node != NULL) {
+                        *link = node->next;
+                }
+        }
+        spinlock_release(&frame_rmap_lock);
+
+        kfree(node);
+}
+
+unsigned
+frame_rmap_count(paddr_t paddr) {
+        unsigned n;
+
+        spinlock_acquire(&frame_rmap_lock);
+        n = frame_rmap_count_locked(frame_entry(paddr));
+        spinlock_release(&frame_rmap_lock);
+        return n;
+}
+
+#if OPT_VMDEBUG
+/**
+*   Check the free lists against the frame table, and every frame's
+*   refcount and reverse map. Panics on the first problem.
+*/
+void
+frame_table_check(void) {
+        struct frame_table_entry * fte, * prev;
+        struct frame_rmap * node;
+        int i, j, nfree;
+        unsigned k, nmaps;
+
+        spinlock_acquire(&frame_table_lock);
+        nfree = 0;
+        for (k=0; k<=FT_MAX_ORDER; k++) {
+                prev = NULL;
+                for (fte = ft_table->free_lists[k]; fte != NULL; fte = fte->next_free) {
+                        i = fte - ft_table->frame_table_arr;
+                        if (fte->prev_free != prev) {
+                                panic("ft: frame %d: bad free list link\n", i);
+                        }
+                        if (fte->in_use_flag || fte->order != k) {
+                                panic("ft: frame %d on order %u list is "
+                                    "in use or order %u\n", i, k, fte->order);
+                        }
+                        if ((i & ((1 << k) - 1)) != 0 ||
+                            i < ft_table->free_ram_frame_start_index ||
+                            i + (1 << k) > ft_table->page_number) {
+                                panic("ft: order %u block at frame %d is "
+                                    "misplaced\n", k, i);
+                        }
+                        for (j=1; j < (1 << k); j++) {
+                                if (fte[j].in_use_flag || fte[j].order != FT_NO_ORDER) {
+                                        panic("ft: frame %d inside free block "
+                                            "%d is in use or a head\n", i + j, i);
+                                }
+                        }
+                        nfree += 1 << k;
+                        prev = fte;
+                }
+        }
+        if (nfree != ft_table->free_frames) {
+                panic("ft: %d frames on the free lists, count says %d\n",
+                    nfree, ft_table->free_frames);
+        }
+        spinlock_release(&frame_table_lock);
+
+        spinlock_acquire(&frame_rmap_lock);
+        for (i=ft_table->free_ram_frame_start_index; i<ft_table->page_number; i++) {
+                fte = &(ft_table->frame_table_arr[i]);
+                nmaps = frame_rmap_count_locked(fte);
+                if (!fte->in_use_flag) {
+                        if (fte->refcount != 0 || nmaps != 0) {
+                                panic("ft: free frame %d has %u references, "
+                                    "%u mappings\n", i, fte->refcount, nmaps);
                         }
+                        continue;
+                }
+                if (nmaps > fte->refcount) {
+                        panic("ft: frame %d has %u mappings but %u "
+                            "references\n", i, nmaps, fte->refcount);
                 }
-                KASSERT(i >= ft_table->free_ram_frame_start_index);
+                if (fte->rmap != 0 &&
+                    hpt_id_as(fte->rmap & HPT_ID_MASK) == NULL) {
+                        panic("ft: frame %d mapped by dead address space "
+                            "%u\n", i, fte->rmap & HPT_ID_MASK);
+                }
+                for (node = fte->rmap_more; node != NULL; node = node->next) {
+                        if (hpt_id_as(node->tag & HPT_ID_MASK) == NULL) {
+                                panic("ft: frame %d mapped by dead address "
+                                    "space %u\n", i, node->tag & HPT_ID_MASK);
+                        }
+                }
+        }
+        spinlock_release(&frame_rmap_lock);
+}
+
+/**
+*   Check every resident page of AS: it must have a translation to an
+*   in-use frame whose reverse map names the page. AS must not be
+*   faulting or changing meanwhile. Panics on the first problem.
+*/
+void
+frame_table_check_as(struct addrspace * as) {
+        struct region * r;
+        struct hpt_entry * entry;
+        struct frame_table_entry * fte;
+        unsigned i;
+        size_t nresident;
+        vaddr_t vpn;
 
-                // trace forward to the end of ft_table->frame_table_arr
-                i = frame_number + 1;
-                for (; i < ft_table->page_number; i++) {
-                        if (ft_table->frame_table_arr[i].in_use_flag == false) {
-                                ft_table->frame_table_arr[frame_number].next_free = &(ft_table->frame_table_arr[i]);
-                                break;
+        for (r = as->first_region; r != NULL; r = r->next_region) {
+                nresident = 0;
+                i = 0;
+                while (bitmap_nextset(r->resident, i, &i) == 0) {
+                        vpn = r->vbase + i * PAGE_SIZE;
+                        i++;
+                        nresident++;
+
+                        entry = hpt_lookup(as, vpn);
+                        if (entry == NULL) {
+                                panic("ft: resident page 0x%x has no "
+                                    "translation\n", vpn);
+                        }
+                        fte = frame_entry(entry->PFN & PAGE_FRAME);
+                        spinlock_acquire(&frame_rmap_lock);
+                        if (!fte->in_use_flag || fte->refcount == 0 ||
+                            !frame_rmap_has_locked(fte, HPT_TAG(as->hpt_id, vpn))) {
+                                panic("ft: page 0x%x maps frame 0x%x, which "
+                                    "doesn't know it\n", vpn,
+                                    entry->PFN & PAGE_FRAME);
                         }
+                        spinlock_release(&frame_rmap_lock);
+                }
+                if (nresident != r->nresident) {
+                        panic("ft: region 0x%x has %u resident pages, "
+                            "count says %u\n", r->vbase, nresident,
+                            r->nresident);
                 }
+        }
+}
+#endif
+
+int
+frame_table_free_count(void) {
+        int nfree = ft_table->free_frames;
+        unsigned i;
+        // other cpus' magazines may change while they are added up
+        for (i=0; i<VM_MAXCPUS; i++) {
+                nfree += ft_magazines[i].count;
+        }
+        return nfree + ft_zero_count;
+}
+
+void
+frame_table_meminfo(struct meminfo * mi) {
+        int frames[FT_NOWNERS];
+        unsigned i, k;
 
-                if (i == ft_table->page_number) {
-                        ft_table->frame_table_arr[frame_number].next_free = NULL;
+        for (k=0; k<FT_NOWNERS; k++) {
+                frames[k] = ft_boot_usage[k];
+                // other cpus may allocate and free while they are added up
+                for (i=0; i<VM_MAXCPUS; i++) {
+                        frames[k] += ft_usage[i].frames[k];
                 }
         }
 
+        mi->mi_pagesize = PAGE_SIZE;
+        mi->mi_total = ft_table->page_number;
+        mi->mi_kernel = frames[FT_OWNER_KERNEL];
+        mi->mi_kheap = frames[FT_OWNER_KHEAP];
+        mi->mi_user = frames[FT_OWNER_USER];
+        mi->mi_pgtable = frames[FT_OWNER_PGTABLE];
+        mi->mi_filecache = frames[FT_OWNER_FILE];
+        mi->mi_free = frame_table_free_count();
+        mi->mi_zeroed = ft_zero_count;
+}
+
+/**
+*   Print the number of free blocks of each order
+*/
+void
+frame_table_printstats(void) {
+        unsigned k, nblocks[FT_MAX_ORDER + 1];
+        int nfree, total;
+        struct frame_table_entry * fte;
+
+        // count under the lock, print after
+        spinlock_acquire(&frame_table_lock);
+        nfree = ft_table->free_frames;
+        for (k=0; k<=FT_MAX_ORDER; k++) {
+                nblocks[k] = 0;
+                for (fte = ft_table->free_lists[k]; fte != NULL; fte = fte->next_free) {
+                        nblocks[k]++;
+                }
+        }
         spinlock_release(&frame_table_lock);
+        total = frame_table_free_count();
+
+        kprintf("ft: %d of %d frames free, %d of them in magazines "
+            "(size %u), %u pre-zeroed\n", total,
+            ft_table->page_number - ft_table->free_ram_frame_start_index,
+            total - nfree - ft_zero_count, ft_magazine_size,
+            ft_zero_count);
+        for (k=0; k<=FT_MAX_ORDER; k++) {
+                kprintf("ft: order %u (%u pages): %u free blocks\n",
+                    k, 1u << k, nblocks[k]);
+        }
 }
 
+size_t
+frame_table_footprint(void) {
+        return sizeof(struct frame_table) +
+                sizeof(struct frame_table_entry) * ft_table->page_number;
+}
@@ -9,245 +9,1700 @@
 #include <spl.h>
 #include <spinlock.h>
 #include <current.h> 
+#include <cpu.h>
+#include <membar.h>
 #include <proc.h>   
 
 /* Place your page table functions here */
-// Use the hash function on wiki
+
+// A bucket array: a directory of chunks of bucket heads, each head
+// the index of the first entry of its chain (HPT_NIL if empty). The
+// directories are static, so a lock-free reader with an out of date
+// view of a table still only reads kernel memory; a missing chunk is
+// NULL.
+struct hpt_table {
+        uint32_t * dir[HPT_MAX_CHUNKS];
+        int order;
+};
+
+// hpt_tables[hpt_cur] is the bucket array. While hpt_rehashing, the
+// other one is the bigger or smaller array entries are being moved
+// to: new entries go there, and lookups check both. Both only change
+// with every stripe lock held.
+static struct hpt_table hpt_tables[2];
+static volatile int hpt_cur;
+static volatile bool hpt_rehashing;
+// next bucket of hpt_tables[hpt_cur] to move, how many are moved, and
+// whether someone is setting up or tearing down an array
+static unsigned hpt_rehash_cursor;
+static unsigned hpt_rehash_done;
+static bool hpt_resize_busy;
+// protects the three above; may be held while taking stripe locks,
+// never taken inside one
+static struct spinlock hpt_resize_lock = SPINLOCK_INITIALIZER;
+
+// index of the first free entry, the list goes through next
+static uint32_t hpt_free_list;
+static int hpt_used;
+static int hpt_pool_size;
+
+// HPT id -> address space, slot 0 unused; hpt_as_next is where the
+// search for a free id starts
+static struct addrspace * hpt_as_table[HPT_MAX_AS];
+static unsigned hpt_as_next;
+static struct spinlock hpt_as_lock = SPINLOCK_INITIALIZER;
+
+// one spinlock per range of buckets, see HPT_LOCK_STRIPES
+static struct spinlock hpt_stripe_locks[HPT_LOCK_STRIPES];
+// protects hpt_free_list and hpt_used, always taken inside a stripe lock
+static struct spinlock hpt_free_lock = SPINLOCK_INITIALIZER;
+
+// Sequence counter per stripe, odd while a writer is changing one of
+// its chains. hpt_lookup reads chains without taking the stripe lock
+// and retries if the counter moved underneath it.
+static volatile unsigned hpt_stripe_seq[HPT_LOCK_STRIPES];
+
+// entry number I, in the pool or (OPT_IPT) in the frame table
+#if OPT_IPT
+#define HPT_ENTRY(i) (&ft_table->frame_table_arr[(i)].ipt_entry)
+#else
+#define HPT_ENTRY(i) (&hash_page_table[(i)])
+#endif
+
+static inline unsigned
+hpt_stripe(uint32_t hash) {
+        return hash >> (32 - HPT_STRIPE_BITS);
+}
+
+/**
+*   Bucket head for HASH in table T, or NULL if its chunk isn't there,
+*   which only a lock-free reader with an out of date view can see.
+*/
+static inline uint32_t *
+hpt_bucket(struct hpt_table * t, uint32_t hash) {
+        uint32_t index = hash >> (32 - t->order);
+        uint32_t * chunk = t->dir[index >> HPT_CHUNK_ORDER];
+
+        if(chunk == NULL) {
+            return NULL;
+        }
+        return &chunk[index & (HPT_CHUNK_SIZE - 1)];
+}
+
+// called with the stripe lock held, around every change to its chains
+static inline void
+hpt_write_begin(unsigned stripe) {
+        hpt_stripe_seq[stripe]++;
+        membar_store_store();
+}
+
+static inline void
+hpt_write_end(unsigned stripe) {
+        membar_store_store();
+        hpt_stripe_seq[stripe]++;
+}
+
+// One slot of a software TLB. asid is the owning address space's full
+// ASID on that cpu (generation included, see ASID_BITS), 0 if the slot
+// is empty; elo is the entry's PFN word, what goes in EntryLo.
+struct stlb_entry {
+        volatile uint32_t asid;
+        vaddr_t VPN;
+        uint32_t elo;
+};
+
+// each cpu's software TLB, by cpu number; NULL before vm_bootstrap or
+// if it could not be allocated
+static struct stlb_entry * stlb[VM_MAXCPUS];
+// see vm_set_stlb
+static volatile bool stlb_on = true;
+
+static inline struct stlb_entry *
+stlb_slot(struct stlb_entry * t, uint32_t asid, vaddr_t VPN) {
+        // consecutive pages get consecutive slots, and each ASID starts
+        // somewhere else in the table
+        uint32_t i = (VPN / PAGE_SIZE) ^
+            ((asid & ASID_MASK) << (STLB_ORDER - ASID_BITS));
+        return &t[i & (STLB_SIZE - 1)];
+}
+
+/**
+*   Look VPN of AS up in this cpu's software TLB, caller is at splhigh.
+*
+*   @return bool    true and *elo set on a hit
+*/
+static bool
+stlb_lookup(struct addrspace * as, vaddr_t VPN, uint32_t * elo) {
+        unsigned cpu = curcpu->c_number;
+        uint32_t asid = as->asid[cpu];
+
+        if(!stlb_on || stlb[cpu] == NULL || asid == 0) {
+            return false;
+        }
+        struct stlb_entry * e = stlb_slot(stlb[cpu], asid, VPN);
+        if(e->asid == asid && e->VPN == VPN) {
+            *elo = e->elo;
+            // another cpu may have invalidated it meanwhile
+            membar_load_load();
+            if(e->asid == asid) {
+                VMSTAT_INC(vs_stlb_hits);
+                return true;
+            }
+        }
+        VMSTAT_INC(vs_stlb_misses);
+        return false;
+}
+
+/**
+*   Put a translation found by hpt_lookup_snap in this cpu's software
+*   TLB, caller is at splhigh. STRIPE and SEQ are the stripe and
+*   sequence number the lookup saw: if a writer changed the stripe since,
+*   its stlb_invalidate may have run before the slot was filled, so the
+*   slot is emptied again.
+*/
+static void
+stlb_fill(struct addrspace * as, vaddr_t VPN, uint32_t elo, unsigned stripe, unsigned seq) {
+        unsigned cpu = curcpu->c_number;
+        uint32_t asid = as->asid[cpu];
+
+        if(!stlb_on || stlb[cpu] == NULL || asid == 0) {
+            return;
+        }
+        struct stlb_entry * e = stlb_slot(stlb[cpu], asid, VPN);
+        e->asid = 0;
+        membar_store_store();
+        e->VPN = VPN;
+        e->elo = elo;
+        membar_store_store();
+        e->asid = asid;
+
+        // pairs with the barrier in stlb_invalidate: either it sees
+        // this slot, or this sees its sequence bump
+        membar_any_any();
+        if(hpt_stripe_seq[stripe] != seq) {
+            e->asid = 0;
+        }
+}
+
+/**
+*   Drop VPN of AS from the software TLB of every cpu. Called after the
+*   translation was deleted or changed and the stripe's sequence counter
+*   bumped.
+*/
+static void
+stlb_invalidate(struct addrspace * as, vaddr_t VPN) {
+        unsigned i;
+
+        membar_any_any();
+        for(i=0; i<cpu_count(); i++) {
+            uint32_t asid = as->asid[i];
+            if(stlb[i] == NULL || asid == 0) {
+                continue;
+            }
+            struct stlb_entry * e = stlb_slot(stlb[i], asid, VPN);
+            if(e->asid == asid && e->VPN == VPN) {
+                e->asid = 0;
+                VMSTAT_INC(vs_stlb_invals);
+            }
+        }
+}
+
+void
+vm_set_stlb(bool on) {
+        stlb_on = on;
+}
+
+/**
+*   Give every cpu its software TLB, from vm_bootstrap once all cpus
+*   are known. A cpu that doesn't get one goes to the HPT every time.
+*/
+static void
+stlb_init(void) {
+        unsigned i;
+
+        for(i=0; i<cpu_count(); i++) {
+            stlb[i] = kmalloc(sizeof(struct stlb_entry) * STLB_SIZE);
+            if(stlb[i] == NULL) {
+                kprintf("vm: no software TLB for cpu %u\n", i);
+                continue;
+            }
+            bzero(stlb[i], sizeof(struct stlb_entry) * STLB_SIZE);
+        }
+}
+
+int
+hpt_as_register(struct addrspace * as) {
+        unsigned i, id;
+
+        spinlock_acquire(&hpt_as_lock);
+        for(i=0; i<HPT_MAX_AS - 1; i++) {
+            id = (hpt_as_next + i) % (HPT_MAX_AS - 1) + 1;
+            if(hpt_as_table[id] == NULL) {
+                hpt_as_table[id] = as;
+                hpt_as_next = id;
+                as->hpt_id = id;
+                spinlock_release(&hpt_as_lock);
+                return 0;
+            }
+        }
+        spinlock_release(&hpt_as_lock);
+        return ENOMEM;
+}
+
+void
+hpt_as_unregister(struct addrspace * as) {
+        spinlock_acquire(&hpt_as_lock);
+        KASSERT(hpt_as_table[as->hpt_id] == as);
+        hpt_as_table[as->hpt_id] = NULL;
+        spinlock_release(&hpt_as_lock);
+}
+
+struct addrspace *
+hpt_entry_as(struct hpt_entry * entry) {
+        return hpt_id_as(entry->tag & HPT_ID_MASK);
+}
+
+struct addrspace *
+hpt_id_as(uint32_t id) {
+        KASSERT(id < HPT_MAX_AS);
+        return hpt_as_table[id];
+}
+
+/**
+*   Print the RSS of each live address space by HPT id, and the total.
+*   The address space can't be freed while its id is looked up under
+*   hpt_as_lock, but the lock isn't held while printing.
+*/
+void
+hpt_print_rss(void) {
+        unsigned id, rss, total = 0, nspaces = 0;
+
+        for(id=1; id<HPT_MAX_AS; id++) {
+            spinlock_acquire(&hpt_as_lock);
+            if(hpt_as_table[id] == NULL) {
+                spinlock_release(&hpt_as_lock);
+                continue;
+            }
+            rss = hpt_as_table[id]->rss;
+            spinlock_release(&hpt_as_lock);
+
+            kprintf("vm: address space %u: %u pages resident\n", id, rss);
+            total += rss;
+            nspaces++;
+        }
+        kprintf("vm: %u address spaces, %u pages resident\n", nspaces, total);
+}
+
+/**
+*   Walk the chain starting at BUCKET for a valid translation with tag
+*   TAG. Safe to call without the stripe lock: entries are never freed,
+*   only recycled through the free list, so a racing reader may wander
+*   into the wrong chain but always reads pool memory, and the walk is
+*   bounded in case it ends up going round in circles. The caller
+*   checks the sequence counter to find out whether the answer can be
+*   trusted.
+*/
+static struct hpt_entry *
+hpt_chain_find(uint32_t * bucket, uint32_t tag) {
+        uint32_t i;
+        int steps = 0;
+
+        if(bucket == NULL) {
+            return NULL;
+        }
+        i = *bucket;
+        while(i < (uint32_t)hpt_pool_size && steps < hpt_pool_size) {
+            struct hpt_entry * cur_hpt_entry = HPT_ENTRY(i);
+            if(cur_hpt_entry->tag == tag) {
+                // check valid bit
+                uint32_t validity = cur_hpt_entry->PFN & TLBLO_VALID;
+                if(validity == TLBLO_VALID) {
+                    return cur_hpt_entry;
+                } 
+            }
+            i = cur_hpt_entry->next;
+            steps++;
+        }
+        return NULL;
+}
+
+// 2^32 / golden ratio, for Fibonacci hashing
+#define HPT_GOLDEN 0x9e3779b9
+
+// hash of an entry tag, see hpt_hash
+static inline uint32_t
+hpt_hash_tag(uint32_t tag) {
+#if HPT_HASH == HPT_HASH_FIBONACCI
+        uint32_t key = (tag >> 12) ^ ((tag & HPT_ID_MASK) * 0x85ebca6b);
+        return key * HPT_GOLDEN;
+#else
+        // buckets are the top bits, so reverse the bits to make the
+        // low bits of (id ^ VPN) pick the bucket like the old mask did
+        uint32_t h = tag;
+        h = ((h >> 1) & 0x55555555) | ((h & 0x55555555) << 1);
+        h = ((h >> 2) & 0x33333333) | ((h & 0x33333333) << 2);
+        h = ((h >> 4) & 0x0f0f0f0f) | ((h & 0x0f0f0f0f) << 4);
+        h = ((h >> 8) & 0x00ff00ff) | ((h & 0x00ff00ff) << 8);
+        return (h >> 16) | (h << 16);
+#endif
+}
+
+/**
+*   Hash of (as, VPN), its top bits pick the bucket in a table of any
+*   size. Address space ids are small and page-aligned VPNs have boring
+*   low bits, so XORing them raw gives long chains; the default hashes
+*   the page number and a mixed up id, and takes the top bits of the
+*   product.
+*/
 uint32_t 
 hpt_hash(struct addrspace *as, vaddr_t VPN) {
-        uint32_t index;
+        return hpt_hash_tag(HPT_TAG(as->hpt_id, VPN));
+}
+
+/**
+*   Allocate the chunks of table T for 2^ORDER buckets, all empty.
+*   Returns ENOMEM (with nothing allocated) if kmalloc fails.
+*/
+static int
+hpt_table_alloc(struct hpt_table * t, int order) {
+        int nchunks = 1 << (order - HPT_CHUNK_ORDER);
+        int i, j;
+
+        for(i=0; i<nchunks; i++) {
+            uint32_t * chunk = kmalloc(sizeof(uint32_t) * HPT_CHUNK_SIZE);
+            if(chunk == NULL) {
+                while(i-- > 0) {
+                    kfree(t->dir[i]);
+                    t->dir[i] = NULL;
+                }
+                return ENOMEM;
+            }
+            for(j=0; j<HPT_CHUNK_SIZE; j++) {
+                chunk[j] = HPT_NIL;
+            }
+            t->dir[i] = chunk;
+        }
+        t->order = order;
+        return 0;
+}
+
+// give back the chunks of a table nobody uses any more
+static void
+hpt_table_free(struct hpt_table * t) {
+        int i;
+
+        for(i=0; i<HPT_MAX_CHUNKS; i++) {
+            uint32_t * chunk = t->dir[i];
+            if(chunk == NULL) {
+                continue;
+            }
+            t->dir[i] = NULL;
+            kfree(chunk);
+        }
+}
+
+/**
+*   Initialization of hash_page_table, use ram_stealmem,
+*   put it on the bottom of RAM. Call this before frametable_init.
+*
+*   The table is split into bucket heads, starting at the smallest size
+*   and resized with the load from then on, and a pool of
+*   HPT_ENTRIES_PER_FRAME entries per frame. All pool entries start on
+*   the free list. With OPT_IPT only the buckets (the hash anchor table)
+*   are allocated here.
+*/
+void
+hpt_init() {
+    paddr_t top_of_ram = ram_getsize();
+    int page_num = top_of_ram / PAGE_SIZE;
+    int i;
+
+    KASSERT(HPT_MIN_ORDER >= HPT_CHUNK_ORDER);
+    KASSERT(HPT_MIN_ORDER >= HPT_STRIPE_BITS);
+
+    hpt_tables[0].order = HPT_MIN_ORDER;
+    hpt_tables[1].order = HPT_MIN_ORDER;
+    if(hpt_table_alloc(&hpt_tables[0], HPT_MIN_ORDER)) {
+        panic("hpt_init: out of memory\n");
+    }
+    hpt_cur = 0;
+    hpt_rehashing = false;
+    hpt_size = 1 << HPT_MIN_ORDER;
+
+#if OPT_IPT
+    // the entries are in the frame table, which frame_table_init
+    // sets up right after this
+    hpt_pool_size = page_num;
+    hash_page_table = NULL;
+    hpt_free_list = HPT_NIL;
+#else
+    hpt_pool_size = HPT_ENTRIES_PER_FRAME * page_num;
+    hash_page_table = (struct hpt_entry *)
+        kmalloc(sizeof(struct hpt_entry) * hpt_pool_size);
+
+    for(i=0; i<hpt_pool_size; i++) {
+        (hash_page_table + i)->tag = 0;
+        (hash_page_table + i)->PFN = 0;
+        (hash_page_table + i)->next = (i == hpt_pool_size - 1) ?
+            HPT_NIL : (uint32_t)(i + 1);
+    }
+    hpt_free_list = 0;
+#endif
+    hpt_used = 0;
+
+    for(i=0; i<HPT_LOCK_STRIPES; i++) {
+        spinlock_init(&hpt_stripe_locks[i]);
+    }
+}
+
+/**
+*   Find a match in hash_page_table, every entry is uniquely
+*   identified by addrspace id and virtual page number.
+*
+*   This is the TLB refill path, so it takes no lock: it snapshots the
+*   stripe's sequence counter, walks the chain, and starts over if a
+*   writer was active or got in meanwhile. Concurrent refills never
+*   block each other. hpt_lookup_snap also hands back the stripe and
+*   the sequence number the walk was good for, for stlb_fill.
+*/
+static struct hpt_entry * 
+hpt_lookup_snap(struct addrspace * as, vaddr_t VPN, unsigned * stripep, unsigned * seqp) {
+        uint32_t tag = HPT_TAG(as->hpt_id, VPN);
+        uint32_t hash = hpt_hash_tag(tag);
+        unsigned stripe = hpt_stripe(hash);
+        struct hpt_entry * found;
+        unsigned seq;
+        int cur;
+
+        *stripep = stripe;
+        while(1) {
+            seq = hpt_stripe_seq[stripe];
+            if(seq & 1) {
+                // writer in progress
+                continue;
+            }
+            membar_load_load();
+
+            cur = hpt_cur;
+            found = hpt_chain_find(hpt_bucket(&hpt_tables[cur], hash), tag);
+            if(found == NULL && hpt_rehashing) {
+                found = hpt_chain_find(
+                    hpt_bucket(&hpt_tables[cur ^ 1], hash), tag);
+            }
+
+            membar_load_load();
+            if(hpt_stripe_seq[stripe] == seq) {
+                *seqp = seq;
+                return found;
+            }
+        }
+}
+
+struct hpt_entry * 
+hpt_lookup(struct addrspace * as, vaddr_t VPN) {
+        unsigned stripe, seq;
+        return hpt_lookup_snap(as, VPN, &stripe, &seq);
+}
+
+/**
+*   Same as hpt_lookup but holds the stripe lock over the walk, for
+*   comparison in the refill benchmark.
+*/
+struct hpt_entry * 
+hpt_lookup_locked(struct addrspace * as, vaddr_t VPN) {
+        uint32_t tag = HPT_TAG(as->hpt_id, VPN);
+        uint32_t hash = hpt_hash_tag(tag);
+        struct spinlock * stripe = &hpt_stripe_locks[hpt_stripe(hash)];
+        struct hpt_entry * found;
+
+        spinlock_acquire(stripe);
+        found = hpt_chain_find(hpt_bucket(&hpt_tables[hpt_cur], hash), tag);
+        if(found == NULL && hpt_rehashing) {
+            found = hpt_chain_find(
+                hpt_bucket(&hpt_tables[hpt_cur ^ 1], hash), tag);
+        }
+        spinlock_release(stripe);
+
+        return found;
+}
+
+// Bucket a new entry for HASH goes in, the array being moved to while
+// rehashing. Called with the stripe lock held.
+static inline uint32_t *
+hpt_insert_bucket(uint32_t hash) {
+        int t = hpt_rehashing ? hpt_cur ^ 1 : hpt_cur;
+        return hpt_bucket(&hpt_tables[t], hash);
+}
+
+/**
+*   Link pointing at the entry with TAG (hash HASH) in either array, or
+*   NULL if there is none. Called with the stripe lock held.
+*/
+static uint32_t *
+hpt_find_link(uint32_t hash, uint32_t tag) {
+        int t = hpt_cur;
+        int tries;
+
+        for(tries = hpt_rehashing ? 2 : 1; tries > 0; tries--) {
+            uint32_t * link = hpt_bucket(&hpt_tables[t], hash);
+            while(*link != HPT_NIL) {
+                if(HPT_ENTRY(*link)->tag == tag) {
+                    return link;
+                }
+                link = &HPT_ENTRY(*link)->next;
+            }
+            t ^= 1;
+        }
+        return NULL;
+}
+
+// PFN with the TLBLO bits for the hpt_insert flag arguments
+static inline paddr_t
+hpt_pfn_bits(paddr_t PFN, int cache_bit, int dirty_bit, int valid_bit) {
+        if(cache_bit == 1) {
+            PFN = PFN | TLBLO_NOCACHE; 
+        }
+        if(dirty_bit > 0) {
+            PFN = PFN | TLBLO_DIRTY;
+        }
+        if(valid_bit == 1) {
+            PFN = PFN | TLBLO_VALID;
+        }
+        return PFN;
+}
+
+/**
+*   Take an entry for a new translation of frame PFN, called with the
+*   free list lock held. Returns its index, or HPT_NIL if there is none.
+*/
+static inline uint32_t
+hpt_entry_alloc(paddr_t PFN) {
+        uint32_t i;
+
+#if OPT_IPT
+        // a frame has exactly one entry, and it must not be mapped yet
+        i = PFN >> 12;
+        if(HPT_ENTRY(i)->tag != 0) {
+            return HPT_NIL;
+        }
+#else
+        (void)PFN;
+        i = hpt_free_list;
+        if(i == HPT_NIL) {
+            return HPT_NIL;
+        }
+        hpt_free_list = HPT_ENTRY(i)->next;
+#endif
+        hpt_used++;
+        return i;
+}
+
+/**
+*   Insert a new entry into hash_page_table. The entry is taken from the
+*   head of the free list and pushed on the front of its chain, so this
+*   is O(1) no matter how full the table is. With OPT_IPT the entry is
+*   the one belonging to frame PFN, and insert fails if it is taken.
+*
+*   @param  struct addrspace *  Its id goes in the entry's tag
+*   @param  vaddr_t             virtual page number
+*   @param  paddr_t             Allocated physical frame on RAM
+*   @param  the last three is the access flag bit
+*
+*   @return hpt_entry *         Newly inserted hpt_entry
+*/
+struct hpt_entry *
+hpt_insert(struct addrspace * as, vaddr_t VPN, paddr_t PFN, int cache_bit, int dirty_bit, int valid_bit) {
+        paddr_t PFN_incorporate_bits = hpt_pfn_bits(PFN, cache_bit, dirty_bit, valid_bit);
+
+        uint32_t tag = HPT_TAG(as->hpt_id, VPN);
+        uint32_t hash = hpt_hash_tag(tag);
+        unsigned stripe_no = hpt_stripe(hash);
+        struct spinlock * stripe = &hpt_stripe_locks[stripe_no];
+
+        spinlock_acquire(stripe);
+
+        spinlock_acquire(&hpt_free_lock);
+        uint32_t new_index = hpt_entry_alloc(PFN);
+        spinlock_release(&hpt_free_lock);
+        if(new_index == HPT_NIL) {
+            // can't inserted an entry then return NULL
+            spinlock_release(stripe);
+            return NULL;
+        }
+        struct hpt_entry * new_hpt_entry = HPT_ENTRY(new_index);
+
+        uint32_t * bucket = hpt_insert_bucket(hash);
+        hpt_write_begin(stripe_no);
+        new_hpt_entry->tag = tag;
+        new_hpt_entry->PFN = PFN_incorporate_bits;
+        new_hpt_entry->next = *bucket;
+        *bucket = new_index;
+        hpt_write_end(stripe_no);
+
+        spinlock_release(stripe);
+        return new_hpt_entry;
+}
+
+/**
+*   Unlink the entry *LINK points to and clear it, called with its
+*   stripe lock held inside hpt_write_begin/end. Returns its index, for
+*   the caller to give back with hpt_entry_free.
+*/
+static inline uint32_t
+hpt_entry_unlink(uint32_t * link) {
+        uint32_t i = *link;
+        struct hpt_entry * cur_hpt_entry = HPT_ENTRY(i);
+
+        *link = cur_hpt_entry->next;
+        cur_hpt_entry->tag = 0;
+        cur_hpt_entry->PFN = 0;
+        return i;
+}
+
+/**
+*   Give unlinked entries back, called with the free list lock held.
+*   FIRST..LAST is a list of N entries linked through next (with OPT_IPT
+*   the entries just stay in their frames).
+*/
+static inline void
+hpt_entry_free(uint32_t first, uint32_t last, int n) {
+#if OPT_IPT
+        (void)first;
+        (void)last;
+#else
+        HPT_ENTRY(last)->next = hpt_free_list;
+        hpt_free_list = first;
+#endif
+        hpt_used -= n;
+}
+
+/**
+*   Find and delete an entry of hash_page_table, the entry is unlinked
+*   from its chain and given back to the free list (or, with OPT_IPT,
+*   just cleared in its frame). Entries never move while they are in use.
+*
+*   @param  struct addrspace *  Owner of the entry
+*   @param  vaddr_t             VPN
+*
+*   @return int                 Indicate success or not
+*/
+int
+hpt_delete(struct addrspace * as, vaddr_t VPN) {
+        uint32_t tag = HPT_TAG(as->hpt_id, VPN);
+        uint32_t hash = hpt_hash_tag(tag);
+        unsigned stripe_no = hpt_stripe(hash);
+        struct spinlock * stripe = &hpt_stripe_locks[stripe_no];
+
+        spinlock_acquire(stripe);
+
+        uint32_t * link = hpt_find_link(hash, tag);
+        if(link != NULL) {
+            hpt_write_begin(stripe_no);
+            uint32_t i = hpt_entry_unlink(link);
+            hpt_write_end(stripe_no);
+
+            spinlock_acquire(&hpt_free_lock);
+            hpt_entry_free(i, i, 1);
+            spinlock_release(&hpt_free_lock);
+        }
+
+        spinlock_release(stripe);
+        if(link != NULL) {
+            stlb_invalidate(as, VPN);
+        }
+        // not exist is fine too
+        return 0;
+}
+
+/**
+*   Clear or set the dirty bit of a translation, so it loads read-only
+*   or writeable. Readers see either the old or the new PFN word; the
+*   sequence counter is still bumped so a software TLB fill racing with
+*   this notices.
+*/
+static int
+hpt_change_dirty(struct addrspace * as, vaddr_t VPN, bool dirty) {
+        uint32_t tag = HPT_TAG(as->hpt_id, VPN);
+        uint32_t hash = hpt_hash_tag(tag);
+        unsigned stripe_no = hpt_stripe(hash);
+        struct spinlock * stripe = &hpt_stripe_locks[stripe_no];
+
+        spinlock_acquire(stripe);
+        uint32_t * link = hpt_find_link(hash, tag);
+        if(link != NULL) {
+            hpt_write_begin(stripe_no);
+            if(dirty) {
+                HPT_ENTRY(*link)->PFN |= TLBLO_DIRTY;
+            } else {
+                HPT_ENTRY(*link)->PFN &= ~TLBLO_DIRTY;
+            }
+            hpt_write_end(stripe_no);
+        }
+        spinlock_release(stripe);
+
+        if(link != NULL) {
+            stlb_invalidate(as, VPN);
+        }
+
+        return link != NULL ? 0 : ENOENT;
+}
+
+int
+hpt_clear_dirty(struct addrspace * as, vaddr_t VPN) {
+        return hpt_change_dirty(as, VPN, false);
+}
+
+int
+hpt_set_dirty(struct addrspace * as, vaddr_t VPN) {
+        return hpt_change_dirty(as, VPN, true);
+}
+
+/**
+*   Point an existing translation at another frame in one step, so a
+*   concurrent fault never finds the page unmapped. The cache and valid
+*   bits stay, the dirty bit is set from DIRTY_BIT. With OPT_IPT the
+*   translation moves to the new frame's entry, in the old one's place
+*   on the chain. The TLBs are the caller's business.
+*
+*   @param  paddr_t *   set to the frame it had; if not 0 on the call,
+*                       the frame it must still have
+*
+*   @return int         ENOENT if there was no translation, EAGAIN if
+*                       it was to another frame than *old, ENOMEM if
+*                       (OPT_IPT) frame PFN is mapped already
+*/
+int
+hpt_remap(struct addrspace * as, vaddr_t VPN, paddr_t PFN, int dirty_bit, paddr_t * old) {
+        uint32_t tag = HPT_TAG(as->hpt_id, VPN);
+        uint32_t hash = hpt_hash_tag(tag);
+        unsigned stripe_no = hpt_stripe(hash);
+        struct spinlock * stripe = &hpt_stripe_locks[stripe_no];
+        int result = 0;
+
+        spinlock_acquire(stripe);
+        uint32_t * link = hpt_find_link(hash, tag);
+        if(link == NULL) {
+            spinlock_release(stripe);
+            return ENOENT;
+        }
+        struct hpt_entry * entry = HPT_ENTRY(*link);
+        paddr_t bits = entry->PFN & (TLBLO_NOCACHE | TLBLO_VALID);
+        if(dirty_bit > 0) {
+            bits |= TLBLO_DIRTY;
+        }
+        if(*old != 0 && *old != (entry->PFN & TLBLO_PPAGE)) {
+            spinlock_release(stripe);
+            return EAGAIN;
+        }
+        *old = entry->PFN & TLBLO_PPAGE;
+
+#if OPT_IPT
+        spinlock_acquire(&hpt_free_lock);
+        uint32_t new_index = hpt_entry_alloc(PFN);
+        spinlock_release(&hpt_free_lock);
+        if(new_index == HPT_NIL) {
+            result = ENOMEM;
+        } else {
+            struct hpt_entry * new_entry = HPT_ENTRY(new_index);
+            uint32_t old_index = *link;
+
+            hpt_write_begin(stripe_no);
+            new_entry->tag = tag;
+            new_entry->PFN = PFN | bits;
+            new_entry->next = entry->next;
+            *link = new_index;
+            entry->tag = 0;
+            entry->PFN = 0;
+            hpt_write_end(stripe_no);
+
+            spinlock_acquire(&hpt_free_lock);
+            hpt_entry_free(old_index, old_index, 1);
+            spinlock_release(&hpt_free_lock);
+        }
+#else
+        hpt_write_begin(stripe_no);
+        entry->PFN = PFN | bits;
+        hpt_write_end(stripe_no);
+#endif
+
+        spinlock_release(stripe);
+        if(result == 0) {
+            stlb_invalidate(as, VPN);
+        }
+        return result;
+}
+
+/**
+*   Hash every item and count how many fall in each stripe, so the batch
+*   calls can skip empty stripes and stop scanning early.
+*/
+static void
+hpt_batch_prepare(struct addrspace * as, struct hpt_batch_item * items, unsigned n, unsigned * per_stripe) {
+        unsigned i;
+
+        for(i=0; i<HPT_LOCK_STRIPES; i++) {
+            per_stripe[i] = 0;
+        }
+        for(i=0; i<n; i++) {
+            items[i].hash = hpt_hash(as, items[i].VPN);
+            items[i].entry = NULL;
+            per_stripe[hpt_stripe(items[i].hash)]++;
+        }
+}
+
+/**
+*   Insert a batch of pages of one address space. Items are handled a
+*   stripe at a time: the stripe lock and the free list lock are taken
+*   once for all the items in that stripe, and lock-free readers of the
+*   stripe retry once for the whole run instead of once per page.
+*
+*   @param  struct addrspace *      Its id goes in the new entries
+*   @param  struct hpt_batch_item * VPN and PFN of each page
+*   @param  unsigned                number of items
+*   @param  the last three is the access flag bit, as for hpt_insert
+*
+*   @return int                     number of items inserted
+*/
+int
+hpt_insert_batch(struct addrspace * as, struct hpt_batch_item * items, unsigned n, int cache_bit, int dirty_bit, int valid_bit) {
+        unsigned per_stripe[HPT_LOCK_STRIPES];
+        unsigned stripe_no, i, seen;
+        int inserted = 0;
+
+        hpt_batch_prepare(as, items, n, per_stripe);
+
+        for(stripe_no=0; stripe_no<HPT_LOCK_STRIPES; stripe_no++) {
+            if(per_stripe[stripe_no] == 0) {
+                continue;
+            }
+            struct spinlock * stripe = &hpt_stripe_locks[stripe_no];
+
+            spinlock_acquire(stripe);
+            spinlock_acquire(&hpt_free_lock);
+            hpt_write_begin(stripe_no);
+
+            seen = 0;
+            for(i=0; i<n && seen<per_stripe[stripe_no]; i++) {
+                if(hpt_stripe(items[i].hash) != stripe_no) {
+                    continue;
+                }
+                seen++;
+
+                uint32_t new_index = hpt_entry_alloc(items[i].PFN);
+                if(new_index == HPT_NIL) {
+                    continue;
+                }
+                struct hpt_entry * new_hpt_entry = HPT_ENTRY(new_index);
+
+                new_hpt_entry->tag = HPT_TAG(as->hpt_id, items[i].VPN);
+                new_hpt_entry->PFN = hpt_pfn_bits(items[i].PFN,
+                    cache_bit, dirty_bit, valid_bit);
+                uint32_t * bucket = hpt_insert_bucket(items[i].hash);
+                new_hpt_entry->next = *bucket;
+                *bucket = new_index;
+
+                items[i].entry = new_hpt_entry;
+                inserted++;
+            }
+
+            hpt_write_end(stripe_no);
+            spinlock_release(&hpt_free_lock);
+            spinlock_release(stripe);
+        }
+
+        return inserted;
+}
+
+/**
+*   Delete a batch of pages of one address space, a stripe at a time
+*   like hpt_insert_batch. The freed entries of a stripe are collected
+*   on a local list and handed back to the free list in one go.
+*
+*   @param  struct addrspace *      Owner of the entries
+*   @param  struct hpt_batch_item * VPN of each page; PFN is set to
+*                                   the old entry's PFN, 0 if none
+*   @param  unsigned                number of items
+*
+*   @return int                     number of entries deleted
+*/
+int
+hpt_delete_batch(struct addrspace * as, struct hpt_batch_item * items, unsigned n) {
+        unsigned per_stripe[HPT_LOCK_STRIPES];
+        unsigned stripe_no, i, seen;
+        int deleted = 0;
+
+        hpt_batch_prepare(as, items, n, per_stripe);
+
+        for(stripe_no=0; stripe_no<HPT_LOCK_STRIPES; stripe_no++) {
+            if(per_stripe[stripe_no] == 0) {
+                continue;
+            }
+            struct spinlock * stripe = &hpt_stripe_locks[stripe_no];
+            uint32_t freed = HPT_NIL;
+            uint32_t freed_tail = HPT_NIL;
+            int nfreed = 0;
+
+            spinlock_acquire(stripe);
+            hpt_write_begin(stripe_no);
+
+            seen = 0;
+            for(i=0; i<n && seen<per_stripe[stripe_no]; i++) {
+                if(hpt_stripe(items[i].hash) != stripe_no) {
+                    continue;
+                }
+                seen++;
+                items[i].PFN = 0;
+
+                uint32_t * link = hpt_find_link(items[i].hash,
+                    HPT_TAG(as->hpt_id, items[i].VPN));
+                if(link == NULL) {
+                    // not exist
+                    continue;
+                }
+
+                items[i].PFN = HPT_ENTRY(*link)->PFN;
+                uint32_t old = hpt_entry_unlink(link);
+
+                HPT_ENTRY(old)->next = freed;
+                if(freed == HPT_NIL) {
+                    freed_tail = old;
+                }
+                freed = old;
+                nfreed++;
+            }
+
+            hpt_write_end(stripe_no);
+
+            if(nfreed > 0) {
+                spinlock_acquire(&hpt_free_lock);
+                hpt_entry_free(freed, freed_tail, nfreed);
+                spinlock_release(&hpt_free_lock);
+            }
+
+            spinlock_release(stripe);
+            deleted += nfreed;
+        }
+
+        for(i=0; i<n; i++) {
+            if(items[i].PFN != 0) {
+                stlb_invalidate(as, items[i].VPN);
+            }
+        }
+
+        return deleted;
+}
+
+int
+hpt_entry_count(void) {
+        return hpt_used;
+}
+
+size_t
+hpt_footprint(void) {
+        size_t bytes = sizeof(hpt_tables) + sizeof(hpt_as_table) +
+            sizeof(uint32_t) * hpt_size;
+        if(hpt_rehashing) {
+            bytes += sizeof(uint32_t) << hpt_tables[hpt_cur ^ 1].order;
+        }
+#if !OPT_IPT
+        bytes += sizeof(struct hpt_entry) * hpt_pool_size;
+#endif
+        return bytes;
+}
+
+// take or drop every stripe lock, to change which arrays are in use
+static void
+hpt_lock_all(void) {
+        int i;
+
+        for(i=0; i<HPT_LOCK_STRIPES; i++) {
+            spinlock_acquire(&hpt_stripe_locks[i]);
+            hpt_write_begin(i);
+        }
+}
+
+static void
+hpt_unlock_all(void) {
+        int i;
+
+        for(i=HPT_LOCK_STRIPES-1; i>=0; i--) {
+            hpt_write_end(i);
+            spinlock_release(&hpt_stripe_locks[i]);
+        }
+}
+
+/**
+*   If the load is out of bounds, allocate the array to move to and
+*   switch inserts over to it. Buckets are moved later, a few per
+*   hpt_rehash_step.
+*/
+static void
+hpt_resize_start(void) {
+        int order = hpt_tables[hpt_cur].order;
+        int new_order;
+
+        if(hpt_used * 100 > (HPT_GROW_LOAD << order) &&
+            order < HPT_MAX_ORDER) {
+            new_order = order + 1;
+        } else if(hpt_used * 100 < (HPT_SHRINK_LOAD << order) &&
+            order > HPT_MIN_ORDER) {
+            new_order = order - 1;
+        } else {
+            return;
+        }
+
+        spinlock_acquire(&hpt_resize_lock);
+        if(hpt_resize_busy || hpt_rehashing) {
+            spinlock_release(&hpt_resize_lock);
+            return;
+        }
+        hpt_resize_busy = true;
+        spinlock_release(&hpt_resize_lock);
+
+        // the spare array is ours now, fill it without holding locks
+        struct hpt_table * to = &hpt_tables[hpt_cur ^ 1];
+        if(hpt_table_alloc(to, new_order)) {
+            spinlock_acquire(&hpt_resize_lock);
+            hpt_resize_busy = false;
+            spinlock_release(&hpt_resize_lock);
+            return;
+        }
+
+        spinlock_acquire(&hpt_resize_lock);
+        hpt_lock_all();
+        hpt_rehash_cursor = 0;
+        hpt_rehash_done = 0;
+        hpt_rehashing = true;
+        hpt_unlock_all();
+        hpt_resize_busy = false;
+        spinlock_release(&hpt_resize_lock);
+}
+
+/**
+*   Move every entry of bucket B of the current array to the array being
+*   moved to. The entries keep their stripe, so only that stripe's lock
+*   is needed.
+*/
+static void
+hpt_rehash_bucket(uint32_t b) {
+        struct hpt_table * from = &hpt_tables[hpt_cur];
+        struct hpt_table * to = &hpt_tables[hpt_cur ^ 1];
+        unsigned stripe_no = b >> (from->order - HPT_STRIPE_BITS);
+        uint32_t * bucket = &from->dir[b >> HPT_CHUNK_ORDER][b & (HPT_CHUNK_SIZE - 1)];
+
+        spinlock_acquire(&hpt_stripe_locks[stripe_no]);
+        hpt_write_begin(stripe_no);
+        while(*bucket != HPT_NIL) {
+            uint32_t i = *bucket;
+            struct hpt_entry * cur_hpt_entry = HPT_ENTRY(i);
+            uint32_t * dest = hpt_bucket(to, hpt_hash_tag(cur_hpt_entry->tag));
+
+            *bucket = cur_hpt_entry->next;
+            cur_hpt_entry->next = *dest;
+            *dest = i;
+        }
+        hpt_write_end(stripe_no);
+        spinlock_release(&hpt_stripe_locks[stripe_no]);
+}
+
+/**
+*   All buckets are moved: make the new array current and free the old
+*   one. hpt_resize_busy keeps a new resize from reusing the old array's
+*   directory until its chunks are gone.
+*/
+static void
+hpt_resize_finish(void) {
+        int old;
+
+        spinlock_acquire(&hpt_resize_lock);
+        hpt_resize_busy = true;
+        hpt_lock_all();
+        old = hpt_cur;
+        hpt_cur = old ^ 1;
+        hpt_rehashing = false;
+        hpt_size = 1 << hpt_tables[hpt_cur].order;
+        hpt_unlock_all();
+        spinlock_release(&hpt_resize_lock);
+
+        hpt_table_free(&hpt_tables[old]);
+
+        spinlock_acquire(&hpt_resize_lock);
+        hpt_resize_busy = false;
+        spinlock_release(&hpt_resize_lock);
+}
+
+void
+hpt_rehash_step(void) {
+        unsigned k, b, oldsize;
+        bool finish = false;
+
+        if(!hpt_rehashing) {
+            hpt_resize_start();
+            return;
+        }
 
-        index = (((uint32_t)as) ^ VPN) % hpt_size;
-        return index;
+        for(k=0; k<HPT_REHASH_STEP && !finish; k++) {
+            spinlock_acquire(&hpt_resize_lock);
+            oldsize = 1 << hpt_tables[hpt_cur].order;
+            if(!hpt_rehashing || hpt_rehash_cursor == oldsize) {
+                spinlock_release(&hpt_resize_lock);
+                break;
+            }
+            b = hpt_rehash_cursor++;
+            spinlock_release(&hpt_resize_lock);
+
+            hpt_rehash_bucket(b);
+
+            spinlock_acquire(&hpt_resize_lock);
+            hpt_rehash_done++;
+            finish = (hpt_rehash_done == oldsize);
+            spinlock_release(&hpt_resize_lock);
+        }
+
+        if(finish) {
+            hpt_resize_finish();
+        }
+}
+
+void
+hpt_printsize(void) {
+        spinlock_acquire(&hpt_resize_lock);
+        kprintf("hpt: %d buckets, %d/%d entries in use, load %d%%\n",
+            hpt_size, hpt_used, hpt_pool_size, hpt_used * 100 / hpt_size);
+        if(hpt_rehashing) {
+            kprintf("hpt: rehashing to %d buckets, %u moved\n",
+                1 << hpt_tables[hpt_cur ^ 1].order, hpt_rehash_done);
+        }
+        spinlock_release(&hpt_resize_lock);
 }
 
+// chains this long or longer share the last histogram slot
+#define HPT_HIST_MAX 8
+
 /**
-*   Initialization of hash_page_table, use ram_stealmem,
-*   put it on the bottom of RAM. Call this before frametable_init.
+*   Print bucket occupancy and a chain-length histogram. Each stripe is
+*   walked under its lock, so every chain is counted consistently; while
+*   rehashing the buckets of both arrays are counted.
 */
 void
-hpt_init() {
-    paddr_t top_of_ram = ram_getsize();
-    int page_num = top_of_ram / PAGE_SIZE;
+hpt_printstats(void) {
+        unsigned hist[HPT_HIST_MAX + 1];
+        int longest = 0;
+        int i, len, stripe, t, tries, width;
 
-    hpt_size = HPT_SIZE_TIMES_LARGE * page_num;
+        for(i=0; i<=HPT_HIST_MAX; i++) {
+            hist[i] = 0;
+        }
 
-    hash_page_table = (struct hpt_entry *)
-        kmalloc(sizeof(struct hpt_entry) * hpt_size);
+        for(stripe=0; stripe<HPT_LOCK_STRIPES; stripe++) {
+            spinlock_acquire(&hpt_stripe_locks[stripe]);
+            t = hpt_cur;
+            for(tries = hpt_rehashing ? 2 : 1; tries > 0; tries--, t ^= 1) {
+                struct hpt_table * table = &hpt_tables[t];
+                width = 1 << (table->order - HPT_STRIPE_BITS);
+                for(i=stripe*width; i<(stripe+1)*width; i++) {
+                    uint32_t cur = table->dir[i >> HPT_CHUNK_ORDER]
+                        [i & (HPT_CHUNK_SIZE - 1)];
+                    len = 0;
+                    while(cur != HPT_NIL) {
+                        len++;
+                        cur = HPT_ENTRY(cur)->next;
+                    }
+                    if(len > longest) {
+                        longest = len;
+                    }
+                    hist[len < HPT_HIST_MAX ? len : HPT_HIST_MAX]++;
+                }
+            }
+            spinlock_release(&hpt_stripe_locks[stripe]);
+        }
 
-    int i;
-    for(i=0; i<hpt_size; i++) {
-        (hash_page_table + i)->Pid = NULL;
-        (hash_page_table + i)->VPN = 0;
-        (hash_page_table + i)->PFN = 0;
-        (hash_page_table + i)->next_entry = NULL;
-    }
+        hpt_printsize();
+        kprintf("hpt: hash %s, longest chain %d\n",
+            HPT_HASH == HPT_HASH_FIBONACCI ? "fibonacci" : "xor", longest);
+        for(i=0; i<=HPT_HIST_MAX; i++) {
+            kprintf("hpt: chain length %d%s: %u\n", i,
+                i == HPT_HIST_MAX ? "+" : "", hist[i]);
+        }
+}
+
+// Per-cpu state of the replacement policies: the next slot for round
+// robin and for each half of the wired slots, the clock hand and
+// reference bits, and whether the clock has left entries without their
+// valid bit in the TLB. Also the stream tlb_prefetch follows: the
+// address space and page of the last refill, the end of the pages
+// preloaded with it, and the window. Only touched by its cpu at
+// splhigh.
+struct tlb_shadow {
+        unsigned rr;
+        unsigned wired_next[2];
+        unsigned hand;
+        bool marked;
+        uint8_t ref[NUM_TLB];
+        struct addrspace * pf_as;
+        vaddr_t pf_from;
+        vaddr_t pf_to;
+        unsigned pf_window;
+};
+
+static struct tlb_shadow tlb_shadows[VM_MAXCPUS];
+// see vm_set_tlb_policy and vm_set_tlb_wired
+static volatile int tlb_policy = TLB_POLICY_RANDOM;
+static volatile bool tlb_wired_on = true;
+// see vm_set_tlb_prefetch
+static volatile unsigned tlb_prefetch_max = TLB_PREFETCH_MAX;
+
+void
+vm_set_tlb_policy(int policy) {
+        KASSERT(policy >= 0 && policy < TLB_NPOLICIES);
+        tlb_policy = policy;
+}
 
-    hpt_lock = lock_create("hpt_lock");
+void
+vm_set_tlb_wired(bool on) {
+        tlb_wired_on = on;
+}
+
+void
+vm_set_tlb_prefetch(unsigned max) {
+        KASSERT(max <= TLB_PREFETCH_MAX);
+        tlb_prefetch_max = max;
 }
 
 /**
-*   Find a match in hash_page_table, every entry is uniquely
-*   identified by addrspace pointer(Pid) and virtual page number
+*   Clock over the slots tlb_random uses. A slot whose reference bit is
+*   set gets a second chance: the bit is cleared, and so is the valid
+*   bit of its entry, so the next use of the page faults and
+*   tlb_clock_rearm sets the reference bit again. The first slot found
+*   unreferenced is the victim; after a full turn every bit is clear, so
+*   the search ends. Caller is at splhigh.
 */
-struct hpt_entry * 
-hpt_lookup(struct addrspace * as, vaddr_t VPN) {
-        lock_acquire(hpt_lock);
+static unsigned
+tlb_clock_victim(struct tlb_shadow * sh) {
+        uint32_t ehi, elo;
+        unsigned i;
 
-        uint32_t index = hpt_hash(as, VPN);
+        while(1) {
+            i = TLB_WIRED + sh->hand;
+            sh->hand = (sh->hand + 1) % (NUM_TLB - TLB_WIRED);
+            if(!sh->ref[i]) {
+                return i;
+            }
+            sh->ref[i] = 0;
+            tlb_read(&ehi, &elo, i);
+            if(elo & TLBLO_VALID) {
+                tlb_write(ehi, elo & ~TLBLO_VALID, i);
+                sh->marked = true;
+            }
+        }
+}
 
-        struct hpt_entry * cur_hpt_entry = (hash_page_table + index);
-        
-        while(cur_hpt_entry != NULL) {
-            if(cur_hpt_entry->Pid == as && cur_hpt_entry->VPN == VPN) {
-                // check valid bit
-                uint32_t validity = cur_hpt_entry->PFN & TLBLO_VALID;
-                if(validity == TLBLO_VALID) {
-                    lock_release(hpt_lock);
-                    return cur_hpt_entry;
-                } 
+/**
+*   Put back the valid bit the clock took from this cpu's entry for VPN
+*   of the running address space, if there is such an entry.
+*
+*   @return bool    true if it was there and the access can go on
+*/
+static bool
+tlb_clock_rearm(vaddr_t VPN) {
+        struct tlb_shadow * sh;
+        uint32_t ehi, elo;
+        bool rearmed = false;
+        int index;
+        int spl = splhigh();
+
+        sh = &tlb_shadows[curcpu->c_number];
+        if(sh->marked) {
+            // probe matches entries without the valid bit too
+            index = tlb_probe(VPN | (curcpu->c_asid << TLBHI_PID_SHIFT), 0);
+            if(index >= 0) {
+                tlb_read(&ehi, &elo, index);
+                if(!(elo & TLBLO_VALID)) {
+                    tlb_write(ehi, elo | TLBLO_VALID, index);
+                    sh->ref[index] = 1;
+                    VMSTAT_INC(vs_tlb_rearms);
+                    rearmed = true;
+                }
             }
-            cur_hpt_entry = cur_hpt_entry->next_entry;
         }
 
-        lock_release(hpt_lock);
-        return NULL;
+        splx(spl);
+        return rearmed;
 }
 
 /**
-*   Insert a new entry into hash_page_table
-*
-*   @param  struct addrspace *  Used as Pid of in hpt_entry
-*   @param  vaddr_t             virtual page number
-*   @param  paddr_t             Allocated physical frame on RAM
-*   @param  the last three is the access flag bit
+*   Slot for a refill of VPN of AS, or -1 to let tlb_random choose.
+*   Pages of the running program's code and stack go in the wired slots
+*   (the first half and the second, in turn) if those are on; the rest
+*   as the policy says. Caller is at splhigh.
+*/
+static int
+tlb_pick_slot(struct addrspace * as, vaddr_t VPN) {
+        struct tlb_shadow * sh = &tlb_shadows[curcpu->c_number];
+        int half = -1;
+
+        if(tlb_wired_on && as != NULL) {
+            if(VPN >= as->text_base && VPN < as->text_end) {
+                half = 0;
+            } else if(as->stack_base != 0 && VPN >= as->stack_base &&
+                      VPN < USERSTACK) {
+                half = 1;
+            }
+        }
+        if(half >= 0) {
+            VMSTAT_INC(vs_tlb_wired);
+            return half * (TLB_WIRED / 2) +
+                sh->wired_next[half]++ % (TLB_WIRED / 2);
+        }
+
+        switch(tlb_policy) {
+            case TLB_POLICY_RR:
+                return TLB_WIRED + sh->rr++ % (NUM_TLB - TLB_WIRED);
+            case TLB_POLICY_CLOCK:
+                return tlb_clock_victim(sh);
+            default:
+                return -1;
+        }
+}
+
+/**
+*   Auxiliary function used to write to TLB
 *
-*   @return hpt_entry *         Newly inserted hpt_entry
+*   The entry is tagged with the ASID as_activate loaded on this cpu,
+*   which belongs to the faulting address space AS. ELO is the PFN word
+*   of a page table entry, or its copy in the software TLB. The slot
+*   comes from tlb_pick_slot, unless the TLB has an entry for VPN
+*   already: another thread of AS may have loaded the page since this
+*   one faulted, or tlb_prefetch may have, and two matching entries
+*   are fatal, so that one is replaced.
 */
-struct hpt_entry *
-hpt_insert(struct addrspace * as, vaddr_t VPN, paddr_t PFN, int cache_bit, int dirty_bit, int valid_bit) {
-        paddr_t PFN_incorporate_bits = PFN;
-        if(cache_bit == 1) {
-            PFN_incorporate_bits = PFN_incorporate_bits | TLBLO_NOCACHE; 
+static void
+tlb_load(struct addrspace * as, vaddr_t VPN, uint32_t elo) {
+        // entry hi, entyr low
+        uint32_t ehi;
+        int spl;
+        int slot;
+
+        if(!(elo & TLBLO_VALID)) {
+            // cleared by a delete that raced with the lookup; the
+            // access faults again and finds out
+            return;
         }
-        if(dirty_bit > 0) {
-            PFN_incorporate_bits = PFN_incorporate_bits | TLBLO_DIRTY;
+
+        // Disable interrupte when write to TLB
+        spl = splhigh();
+
+        ehi = VPN | (curcpu->c_asid << TLBHI_PID_SHIFT);
+
+        slot = tlb_probe(ehi, 0);
+        if(slot < 0) {
+            slot = tlb_pick_slot(as, VPN);
         }
-        if(valid_bit == 1) {
-            PFN_incorporate_bits = PFN_incorporate_bits | TLBLO_VALID;
+        if(slot < 0) {
+            tlb_random(ehi, elo);
+        } else {
+            tlb_write(ehi, elo, slot);
+            tlb_shadows[curcpu->c_number].ref[slot] = 1;
         }
 
-        uint32_t index = hpt_hash(as, VPN);
+        splx(spl);
+}
+
+void 
+write_to_tlb(struct hpt_entry * entry) {
+        tlb_load(hpt_entry_as(entry), HPT_ENTRY_VPN(entry), entry->PFN);
+}
 
-        lock_acquire(hpt_lock);
+/**
+*   Invalidate the whole TLB of this cpu, caller is at splhigh
+*/
+void
+vm_tlb_flush(void) {
+        int i;
+        // use TLBHI_INVALID(i) is enough, won't cause duplicated entry
+        for (i=0; i<NUM_TLB; i++) {
+                tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+        }
+        struct tlb_shadow * sh = &tlb_shadows[curcpu->c_number];
+        bzero(sh->ref, sizeof(sh->ref));
+        sh->marked = false;
+        VMSTAT_INC(vs_tlb_flushes);
+}
 
-        struct hpt_entry * cur_hpt_entry = (hash_page_table + index);
+// ASID of AS in this cpu's TLB, 0 if it has none in the current
+// generation, so no entries either. Caller is at splhigh.
+static uint32_t
+tlb_asid(struct addrspace * as) {
+        struct cpu * c = curcpu;
+        uint32_t asid = as->asid[c->c_number];
 
-        // find the entry that the next_entry field is NULL
-        while(cur_hpt_entry->next_entry != NULL) {
-            cur_hpt_entry = cur_hpt_entry->next_entry;
+        if(asid == 0 || (asid >> ASID_BITS) != c->c_asid_gen) {
+            return 0;
         }
+        return asid & ASID_MASK;
+}
+
+// tlb_probe and tlb_write leave their ASID in EntryHi; put the running
+// address space's back, as as_activate does. Caller is at splhigh.
+static void
+tlb_restore_asid(void) {
+        tlb_probe(TLBHI_INVALID(0) | (curcpu->c_asid << TLBHI_PID_SHIFT), 0);
+}
 
-        // the very first empty entry or attached to the current entry
-        if(cur_hpt_entry->Pid == NULL && cur_hpt_entry->VPN == 0 && cur_hpt_entry->PFN == 0) {
-            // write to cur_hpt_entry
-            cur_hpt_entry->Pid = as;
-            cur_hpt_entry->VPN = VPN;
-            cur_hpt_entry->PFN = PFN_incorporate_bits;
-            cur_hpt_entry->next_entry = NULL;
+/**
+*   Drop this cpu's TLB entries tagged ASID for NPAGES pages from VPN
+*   on, caller is at splhigh. A short range is probed page by page; one
+*   as long as the TLB takes a single pass reading every slot instead.
+*   Other entries stay.
+*/
+static void
+tlb_invalidate_asid(uint32_t asid, vaddr_t VPN, unsigned npages) {
+        struct tlb_shadow * sh = &tlb_shadows[curcpu->c_number];
+        uint32_t ehi, elo;
+        unsigned i;
+        int index;
 
-            lock_release(hpt_lock);
-            return cur_hpt_entry;
+        if(npages < NUM_TLB) {
+            for(i=0; i<npages; i++) {
+                index = tlb_probe((VPN + i * PAGE_SIZE) |
+                    (asid << TLBHI_PID_SHIFT), 0);
+                if(index >= 0) {
+                    tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
+                    sh->ref[index] = 0;
+                    VMSTAT_INC(vs_tlb_invals);
+                }
+            }
         } else {
-            // attach to cur_hpt_entry
-            int i;
-            for (i=0; i<hpt_size; i++) {
-                // find an empty slot
-                struct hpt_entry * temp_hpt_entry = (hash_page_table + i);
-                if(temp_hpt_entry->Pid == NULL && temp_hpt_entry->VPN == 0 && temp_hpt_entry->PFN == 0) {
-                    temp_hpt_entry->Pid = as;
-                    temp_hpt_entry->VPN = VPN;
-                    temp_hpt_entry->PFN = PFN_incorporate_bits;
-                    temp_hpt_entry->next_entry = NULL;
-
-                    cur_hpt_entry->next_entry = temp_hpt_entry;
-                    
-                    lock_release(hpt_lock);
-                    return temp_hpt_entry;
+            vaddr_t end = VPN + npages * PAGE_SIZE;
+            for(i=0; i<NUM_TLB; i++) {
+                tlb_read(&ehi, &elo, i);
+                // the valid bit doesn't matter, see tlb_clock_victim
+                if(((ehi & TLBHI_PID) >> TLBHI_PID_SHIFT) == asid &&
+                   (ehi & TLBHI_VPAGE) >= VPN &&
+                   (ehi & TLBHI_VPAGE) < end) {
+                    tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+                    sh->ref[i] = 0;
+                    VMSTAT_INC(vs_tlb_invals);
                 }
             }
         }
 
-        lock_release(hpt_lock);
-        // can't inserted an entry then return NULL
-        return NULL;
+        tlb_restore_asid();
+}
+
+void
+vm_tlb_invalidate(struct addrspace * as, vaddr_t VPN, unsigned npages) {
+        int spl = splhigh();
+        uint32_t asid = tlb_asid(as);
+
+        if(asid != 0) {
+            tlb_invalidate_asid(asid, VPN, npages);
+        }
+        splx(spl);
 }
 
 /**
-*   Find and delete an entry of hash_page_table
-*
-*   @param  struct addrspace *  Pid
-*   @param  vaddr_t             VPN
-*
-*   @return int                 Indicate success or not
+*   Drop NPAGES pages of AS from VPN on from every TLB that can hold
+*   them: this cpu's directly, and those of the other cpus in
+*   as->cpumask that still have an ASID of their current generation for
+*   it through one shootdown request each. With WAIT, return only once
+*   they have all been handled, which needs interrupts on and no
+*   spinlocks held. Call after changing the page table.
 */
-int
-hpt_delete(struct addrspace * as, vaddr_t VPN) {
-        lock_acquire(hpt_lock);
+void
+vm_tlb_shootdown(struct addrspace * as, vaddr_t VPN, unsigned npages, bool wait) {
+        struct tlbshootdown ts;
+        unsigned tickets[VM_MAXCPUS];
+        uint32_t sent = 0;
+        unsigned i;
+        int spl;
 
-        uint32_t index = hpt_hash(as, VPN);
+        ts.ts_vaddr = VPN;
+        ts.ts_npages = npages;
 
-        struct hpt_entry * cur_hpt_entry = (hash_page_table + index);
-        
-        // the entry going to be deleted is in the head/ on the index
-        if(cur_hpt_entry->Pid == as && cur_hpt_entry->VPN == VPN) {
-            if(cur_hpt_entry->next_entry == NULL) {
-                cur_hpt_entry->Pid = NULL;
-                cur_hpt_entry->VPN = 0;
-                cur_hpt_entry->PFN = 0;
-                cur_hpt_entry->next_entry = NULL;
-
-                lock_release(hpt_lock);
-                return 0;
-            } else {
-                // move the next entry to current entry, since it is
-                // a chain, but only next entry is enough
-                // and we need to clear contents of next_entry
-                cur_hpt_entry->Pid = cur_hpt_entry->next_entry->Pid;
-                cur_hpt_entry->next_entry->Pid = NULL;
-                cur_hpt_entry->VPN = cur_hpt_entry->next_entry->VPN;
-                cur_hpt_entry->next_entry->VPN = 0;
-                cur_hpt_entry->PFN = cur_hpt_entry->next_entry->PFN;
-                cur_hpt_entry->next_entry->PFN = 0;
-                struct hpt_entry * temp_hpt_entry = cur_hpt_entry->next_entry->next_entry;
-                cur_hpt_entry->next_entry->next_entry = NULL;
-                cur_hpt_entry->next_entry = temp_hpt_entry;
-
-                lock_release(hpt_lock);
-                return 0;
-            }
-        }
+        // stay on this cpu while telling it apart from the others
+        spl = splhigh();
+        vm_tlb_invalidate(as, VPN, npages);
 
+        uint32_t mask = as->cpumask & ~((uint32_t)1 << curcpu->c_number);
+        membar_load_load();
+        for(i=0; i<cpu_count() && mask != 0; i++) {
+            if(!(mask & ((uint32_t)1 << i))) {
+                continue;
+            }
+            mask &= ~((uint32_t)1 << i);
 
-        // the entry is in the middle/end of the chain
-        // and the first entry is inspected previously.
-        struct hpt_entry * previous_hpt_entry = cur_hpt_entry;
-        cur_hpt_entry = cur_hpt_entry->next_entry;
+            struct cpu * c = cpu_bynumber(i);
+            ts.ts_asid = as->asid[i];
+            if(ts.ts_asid == 0 || (ts.ts_asid >> ASID_BITS) != c->c_asid_gen) {
+                // its entries there went with a rollover
+                continue;
+            }
+            tickets[i] = ipi_tlbshootdown(c, &ts);
+            sent |= (uint32_t)1 << i;
+            VMSTAT_INC(vs_shootdowns);
+        }
+        splx(spl);
 
-        while(cur_hpt_entry != NULL) {
-            if(cur_hpt_entry->Pid == as && cur_hpt_entry->VPN == VPN) {
-                // in the end of the chain
-                if(cur_hpt_entry->next_entry == NULL) {
-                    cur_hpt_entry->Pid = NULL;
-                    cur_hpt_entry->VPN = 0;
-                    cur_hpt_entry->PFN = 0;
-                    cur_hpt_entry->next_entry = NULL;
+        if(!wait || sent == 0) {
+            return;
+        }
+        // the targets may be waiting on us the same way
+        KASSERT(curthread->t_curspl == 0);
+        KASSERT(curcpu->c_spinlocks == 0);
+        for(i=0; i<cpu_count(); i++) {
+            if(!(sent & ((uint32_t)1 << i))) {
+                continue;
+            }
+            struct cpu * c = cpu_bynumber(i);
+            while((int)(c->c_shootdown_done - tickets[i]) < 0) {
+                membar_load_load();
+            }
+        }
+}
 
-                    previous_hpt_entry->next_entry = NULL;
+bool
+vm_tlb_probe(struct addrspace * as, vaddr_t VPN) {
+        uint32_t asid;
+        int index = -1;
+        int spl = splhigh();
 
-                    lock_release(hpt_lock);
-                    return 0;
-                } else {
-                    // in the middle of the chain
-                    // change the pointer of previous chain next_entry.
-                    // clear the content of current entry
-                    cur_hpt_entry->Pid = NULL;
-                    cur_hpt_entry->VPN = 0;
-                    cur_hpt_entry->PFN = 0;
-
-                    previous_hpt_entry->next_entry = cur_hpt_entry->next_entry;
-                    cur_hpt_entry->next_entry = NULL;
-
-                    lock_release(hpt_lock);
-                    return 0;
-                }
-            }
-            previous_hpt_entry = cur_hpt_entry;
-            cur_hpt_entry = cur_hpt_entry->next_entry;
+        asid = tlb_asid(as);
+        if(asid != 0) {
+            index = tlb_probe(VPN | (asid << TLBHI_PID_SHIFT), 0);
+            tlb_restore_asid();
         }
 
-        lock_release(hpt_lock);
-        // not exist
-        return 0;
+        splx(spl);
+        return index >= 0;
 }
 
 /**
-*   Auxiliary function used to write to TLB
+*   Add up the VM counters of all cpus
+*
+*   @param total filled with the sums
 */
-void 
-write_to_tlb(struct hpt_entry * entry) {
-        // entry hi, entyr low
-        uint32_t ehi, elo;
-        int spl;
-        // Disable interrupte when write to TLB
-        spl = splhigh();
+void
+vmstats_total(struct vmstats * total) {
+        unsigned i;
+        bzero(total, sizeof(*total));
+        for(i=0; i<cpu_count(); i++) {
+                struct vmstats * vs = &cpu_bynumber(i)->c_vmstats;
+                total->vs_faults += vs->vs_faults;
+                total->vs_refills += vs->vs_refills;
+                total->vs_fastpath += vs->vs_fastpath;
+                total->vs_newpages += vs->vs_newpages;
+                total->vs_activates += vs->vs_activates;
+                total->vs_asid_allocs += vs->vs_asid_allocs;
+                total->vs_asid_rollovers += vs->vs_asid_rollovers;
+                total->vs_tlb_flushes += vs->vs_tlb_flushes;
+                total->vs_tlb_invals += vs->vs_tlb_invals;
+                total->vs_shootdowns += vs->vs_shootdowns;
+                total->vs_shootdowns_recv += vs->vs_shootdowns_recv;
+                total->vs_shootdown_flushes += vs->vs_shootdown_flushes;
+                total->vs_tlb_wired += vs->vs_tlb_wired;
+                total->vs_tlb_rearms += vs->vs_tlb_rearms;
+                total->vs_tlb_prefetched += vs->vs_tlb_prefetched;
+                total->vs_prefetch_seq += vs->vs_prefetch_seq;
+                total->vs_cow_shared += vs->vs_cow_shared;
+                total->vs_cow_copies += vs->vs_cow_copies;
+                total->vs_cow_reuses += vs->vs_cow_reuses;
+                total->vs_zero_pool += vs->vs_zero_pool;
+                total->vs_zero_sync += vs->vs_zero_sync;
+                total->vs_zero_skip += vs->vs_zero_skip;
+                total->vs_zero_idle += vs->vs_zero_idle;
+                total->vs_wmark_low += vs->vs_wmark_low;
+                total->vs_reserve += vs->vs_reserve;
+                total->vs_throttle += vs->vs_throttle;
+                total->vs_throttle_fail += vs->vs_throttle_fail;
+                total->vs_reclaim_runs += vs->vs_reclaim_runs;
+                total->vs_reclaimed += vs->vs_reclaimed;
+                total->vs_stlb_hits += vs->vs_stlb_hits;
+                total->vs_stlb_misses += vs->vs_stlb_misses;
+                total->vs_stlb_invals += vs->vs_stlb_invals;
+        }
+}
+
+void
+vmstats_print(void) {
+        struct vmstats t;
+        vmstats_total(&t);
+        kprintf("vm: %u faults, %u refills (%u without a region walk), "
+            "%u new pages\n", t.vs_faults, t.vs_refills, t.vs_fastpath,
+            t.vs_newpages);
+        kprintf("vm: %u activates, %u ASIDs handed out, %u rollovers, "
+            "%u TLB flushes, %u TLB entries invalidated\n",
+            t.vs_activates, t.vs_asid_allocs, t.vs_asid_rollovers,
+            t.vs_tlb_flushes, t.vs_tlb_invals);
+        kprintf("vm: %u TLB shootdowns sent, %u handled, %u coalesced "
+            "into flushes\n", t.vs_shootdowns, t.vs_shootdowns_recv,
+            t.vs_shootdown_flushes);
+        kprintf("vm: %u refills into wired slots, %u clock reference "
+            "faults\n", t.vs_tlb_wired, t.vs_tlb_rearms);
+        kprintf("vm: %u translations prefetched, %u faults continued "
+            "a sequential stream\n", t.vs_tlb_prefetched,
+            t.vs_prefetch_seq);
+        kprintf("vm: %u pages shared copy-on-write by fork, %u copied on "
+            "write, %u written in place by the last holder\n",
+            t.vs_cow_shared, t.vs_cow_copies, t.vs_cow_reuses);
+        kprintf("vm: frames %u pre-zeroed, %u zeroed on allocation, "
+            "%u not zeroed; %u zeroed in the background\n",
+            t.vs_zero_pool, t.vs_zero_sync, t.vs_zero_skip,
+            t.vs_zero_idle);
+        kprintf("vm: below low %u times, %u reclaim passes gave back %u "
+            "frames\n", t.vs_wmark_low, t.vs_reclaim_runs, t.vs_reclaimed);
+        kprintf("vm: below min: %u kernel allocations from the reserve, "
+            "%u user allocations throttled, %u failed\n", t.vs_reserve,
+            t.vs_throttle, t.vs_throttle_fail);
+        // no 64-bit division in the kernel, keep hits * 100 in range
+        unsigned lookups = t.vs_stlb_hits + t.vs_stlb_misses;
+        unsigned rate = 0;
+        if(lookups >= 0x1000000) {
+            rate = t.vs_stlb_hits / (lookups / 100);
+        } else if(lookups > 0) {
+            rate = t.vs_stlb_hits * 100 / lookups;
+        }
+        kprintf("vm: software TLB %u hits, %u misses (%u%% hit rate), "
+            "%u invalidations\n", t.vs_stlb_hits, t.vs_stlb_misses,
+            rate, t.vs_stlb_invals);
+}
 
-        ehi = entry->VPN;
-        elo = entry->PFN;
+// size of the pointer-linked entries (as, VPN, PFN, next) the packed
+// ones replaced, and how many of those there were per frame
+#define HPT_UNPACKED_ENTRY 16
+#if OPT_IPT
+#define HPT_UNPACKED_PER_FRAME 1
+#define HPT_PACKED_PER_FRAME   1
+#else
+#define HPT_UNPACKED_PER_FRAME HPT_SIZE_TIMES_LARGE
+#define HPT_PACKED_PER_FRAME   HPT_ENTRIES_PER_FRAME
+#endif
 
-        tlb_random(ehi, elo);
+/**
+*   Print what buckets plus entries take now and what they took with
+*   fixed pointer bucket heads and unpacked entries, wherever the
+*   entries live.
+*/
+static void
+hpt_footprint_report(void) {
+        size_t frames = hpt_pool_size / HPT_PACKED_PER_FRAME;
+        size_t now = hpt_footprint();
+        // the unpacked table had a fixed HPT_SIZE_TIMES_LARGE buckets
+        // per frame, rounded down to a power of two
+        size_t buckets = 1;
+        while(buckets * 2 <= HPT_SIZE_TIMES_LARGE * frames) {
+            buckets *= 2;
+        }
+        size_t before = sizeof(struct hpt_entry *) * buckets +
+            HPT_UNPACKED_ENTRY * HPT_UNPACKED_PER_FRAME * frames;
 
-        splx(spl);
+#if OPT_IPT
+        now += sizeof(struct hpt_entry) * hpt_pool_size;
+#endif
+        kprintf("vm: %u byte page table entries, table %uk "
+            "(%uk with %u byte entries)\n",
+            sizeof(struct hpt_entry), now / 1024, before / 1024,
+            HPT_UNPACKED_ENTRY);
 }
 
 void 
@@ -261,7 +1716,212 @@ vm_bootstrap(void)
         // wil ramsteal, won't be managed by frame_table
         hpt_init();
 
-		frame_table_init();
+        frame_table_init();
+        frame_table_start_zeroer();
+        frame_table_start_reclaim();
+
+        // with OPT_IPT the page table entries are counted in the frame table
+        kprintf("vm: %s page table %uk, frame table %uk, total %uk\n",
+            OPT_IPT ? "inverted" : "hashed",
+            hpt_footprint() / 1024, frame_table_footprint() / 1024,
+            (hpt_footprint() + frame_table_footprint()) / 1024);
+        hpt_footprint_report();
+
+        stlb_init();
+
+        // everything at boot is set up, hand the unused stolen frames over
+        frame_table_reclaim_boot();
+}
+
+// see vm_set_fastpath
+static volatile bool vm_fastpath = true;
+
+void
+vm_set_fastpath(bool on) {
+        vm_fastpath = on;
+}
+
+/**
+*   Preload the TLB with the pages after VPN of AS, which the running
+*   program just faulted on, caller is at splhigh. The window adapts to
+*   the access pattern: a fault past the last one's page, but no further
+*   than the first page that wasn't preloaded with it, continues a
+*   sequential stream and doubles the window, up to the limit
+*   vm_set_tlb_prefetch set; any other fault halves it. So random
+*   access preloads nothing. Stops at the first page that isn't
+*   resident, and skips those the TLB has already. A translation is
+*   taken from the software TLB or the HPT as it is, dirty bit and all,
+*   as a refill of that page would.
+*/
+static void
+tlb_prefetch(struct addrspace * as, vaddr_t VPN) {
+        struct tlb_shadow * sh = &tlb_shadows[curcpu->c_number];
+        unsigned max = tlb_prefetch_max;
+        struct hpt_entry * entry;
+        unsigned stripe, seq, i;
+        uint32_t elo;
+        vaddr_t next;
+
+        if(as == sh->pf_as && VPN > sh->pf_from && VPN <= sh->pf_to) {
+            sh->pf_window = sh->pf_window == 0 ? 1 : sh->pf_window * 2;
+            VMSTAT_INC(vs_prefetch_seq);
+        } else {
+            sh->pf_window /= 2;
+        }
+        if(sh->pf_window > max) {
+            sh->pf_window = max;
+        }
+        sh->pf_as = as;
+        sh->pf_from = VPN;
+        sh->pf_to = VPN + PAGE_SIZE;
+
+        for(i=1; i<=sh->pf_window; i++) {
+            next = VPN + i * PAGE_SIZE;
+            if(!stlb_lookup(as, next, &elo)) {
+                entry = hpt_lookup_snap(as, next, &stripe, &seq);
+                if(entry == NULL) {
+                    break;
+                }
+                elo = entry->PFN;
+                // the entry may have been deleted and reused meanwhile
+                membar_load_load();
+                if(hpt_stripe_seq[stripe] != seq) {
+                    break;
+                }
+            }
+            sh->pf_to = next + PAGE_SIZE;
+            if(tlb_probe(next | (curcpu->c_asid << TLBHI_PID_SHIFT), 0)
+               >= 0) {
+                continue;
+            }
+            tlb_load(as, next, elo);
+            VMSTAT_INC(vs_tlb_prefetched);
+        }
+}
+
+/**
+*   Refill the TLB from the software TLB or else the HPT, without
+*   looking at regions, if the translation is there and allows the
+*   access. The HPT entry, if one was looked up, is left in *entryp for
+*   the slow path. Either way the pages after VPN may be preloaded, see
+*   tlb_prefetch.
+*
+*   @return bool    true if the TLB was loaded
+*/
+static bool
+vm_refill(struct addrspace * as, vaddr_t VPN, int faulttype, struct hpt_entry ** entryp) {
+        bool write = faulttype == VM_FAULT_WRITE;
+        struct hpt_entry * entry;
+        unsigned stripe, seq;
+        uint32_t elo;
+        bool loaded = false;
+        // the software TLB is this cpu's, stay on it
+        int spl = splhigh();
+
+        if(stlb_lookup(as, VPN, &elo) && (!write || (elo & TLBLO_DIRTY))) {
+            tlb_load(as, VPN, elo);
+            loaded = true;
+        } else {
+            entry = hpt_lookup_snap(as, VPN, &stripe, &seq);
+            *entryp = entry;
+            if(entry != NULL) {
+                elo = entry->PFN;
+                stlb_fill(as, VPN, elo, stripe, seq);
+                if(!write || (elo & TLBLO_DIRTY)) {
+                    tlb_load(as, VPN, elo);
+                    loaded = true;
+                }
+            }
+        }
+
+        if(tlb_prefetch_max > 0) {
+            tlb_prefetch(as, VPN);
+        }
+
+        splx(spl);
+        return loaded;
+}
+
+/**
+*   Give AS a writeable page of its own at VPN, after a write to a page
+*   of a writeable region whose translation has no dirty bit: as_copy
+*   shares a fork's frames read-only between parent and child. While
+*   the frame has other references the page gets a copy; the last one
+*   left just gets the dirty bit back. Either way the read-only
+*   translation is shot down wherever it may be, and waited for, so no
+*   thread of AS reads the shared frame after this one wrote its copy.
+*   Only taken at spl0 with no spinlocks held, as any fault that can
+*   allocate.
+*/
+static int
+vm_cow_fault(struct addrspace * as, vaddr_t VPN) {
+        struct hpt_entry * entry;
+        paddr_t pa, newpa, old;
+        unsigned stripe, seq, refs;
+        uint32_t elo;
+        vaddr_t kva;
+        int result, spl;
+
+        KASSERT(curthread->t_curspl == 0);
+        KASSERT(curcpu->c_spinlocks == 0);
+
+        // the PFN word and the frame's references as of one version of
+        // the stripe, so they belong to the same translation
+        do {
+            entry = hpt_lookup_snap(as, VPN, &stripe, &seq);
+            if(entry == NULL) {
+                // unmapped meanwhile, the access faults again
+                return 0;
+            }
+            elo = entry->PFN;
+            refs = frame_refcount(elo & PAGE_FRAME);
+            membar_load_load();
+        } while(hpt_stripe_seq[stripe] != seq);
+        pa = elo & PAGE_FRAME;
+
+        if(!(elo & TLBLO_DIRTY)) {
+            if(refs == 1) {
+                // only AS holds it now, and nothing can share it again
+                // while AS is faulting
+                hpt_set_dirty(as, VPN);
+                VMSTAT_INC(vs_cow_reuses);
+            } else {
+                // the other holders only read it, so it can't change
+                // under the copy
+                kva = alloc_kpages_flags(1, AKP_USER);
+                if(kva == 0) {
+                    return ENOMEM;
+                }
+                newpa = KVADDR_TO_PADDR(kva);
+                memmove((void *)kva, (const void *)PADDR_TO_KVADDR(pa),
+                    PAGE_SIZE);
+                result = frame_rmap_add(newpa, as, VPN);
+                KASSERT(result == 0);
+
+                old = pa;
+                result = hpt_remap(as, VPN, newpa, 1, &old);
+                if(result) {
+                    // another thread of AS copied or unmapped it first,
+                    // use what it left
+                    frame_rmap_remove(newpa, as, VPN);
+                    frame_unref(newpa);
+                    return 0;
+                }
+                frame_rmap_remove(pa, as, VPN);
+                frame_unref(pa);
+                VMSTAT_INC(vs_cow_copies);
+            }
+            vm_tlb_shootdown(as, VPN, 1, true);
+        }
+
+        // as in vm_fault; tlb_load replaces the read-only entry
+        spl = splhigh();
+        entry = hpt_lookup(as, VPN);
+        if(entry != NULL) {
+            write_to_tlb(entry);
+        }
+        splx(spl);
+        return 0;
 }
 
 /**
@@ -290,9 +1950,35 @@ vm_fault(int faulttype, vaddr_t faultaddress)
             return EFAULT;
         }
 
+        VMSTAT_INC(vs_faults);
+
+        // a page the clock took the valid bit away from
+        if(faulttype != VM_FAULT_READONLY &&
+           tlb_clock_rearm(faultaddress & PAGE_FRAME)) {
+            return 0;
+        }
+
         // transform to VPN
         vaddr_t vir_page_num = faultaddress & PAGE_FRAME;
         // KASSERT(vir_page_num != 0);
+
+        /******* fast path: resident page, only the TLB lost it *******/
+        // The entry's bits came from its region when the page was
+        // mapped (and as_complete_load takes the dirty bit away from
+        // pages of read-only regions), so they stand in for the region
+        // walk. A write to a page without the dirty bit goes the slow
+        // way, and fails there unless it is a copy-on-write page. This
+        // cpu's software TLB is tried before the HPT.
+        struct hpt_entry * lookup_valid_translation_in_hpt = NULL;
+        if(vm_fastpath &&
+           (faulttype == VM_FAULT_READ || faulttype == VM_FAULT_WRITE)) {
+            if(vm_refill(as, vir_page_num, faulttype,
+                         &lookup_valid_translation_in_hpt)) {
+                VMSTAT_INC(vs_refills);
+                VMSTAT_INC(vs_fastpath);
+                return 0;
+            }
+        }
         
         /************* check region validity **************/
         struct region* _region = vaddr_region_mapping(as, vir_page_num);
@@ -303,8 +1989,12 @@ vm_fault(int faulttype, vaddr_t faultaddress)
         
         switch (faulttype) {
             case VM_FAULT_READONLY:
-                /* We always create pages read-write, so we can't get this */
-                return EFAULT;
+                // a write to a page loaded without the dirty bit: fine
+                // in a writeable region, where it is copy-on-write
+                if (!_region->is_writeable) {
+                    return EFAULT;
+                }
+                break;
 
             case VM_FAULT_READ:
                 // KASSERT(_region->is_readable > 0);
@@ -325,18 +2015,33 @@ vm_fault(int faulttype, vaddr_t faultaddress)
         }
 
         /***** look up hpt to see if there is a valid translation *****/
-        struct hpt_entry * lookup_valid_translation_in_hpt = 
-            hpt_lookup(as, vir_page_num);
-
-        if(lookup_valid_translation_in_hpt != NULL) {
-            // find valid translation, load TLB
-            write_to_tlb(lookup_valid_translation_in_hpt);
-            return 0;
+        // (again) at splhigh until the TLB is written, so a shootdown
+        // for a translation changed in between is taken after the
+        // write and removes it. Nothing to do if the fast path found no
+        // translation. A write to a translation without the dirty bit
+        // here is to a copy-on-write page.
+        if(!vm_fastpath || lookup_valid_translation_in_hpt != NULL ||
+           faulttype == VM_FAULT_READONLY) {
+            int spl = splhigh();
+            lookup_valid_translation_in_hpt = hpt_lookup(as, vir_page_num);
+            if(lookup_valid_translation_in_hpt != NULL &&
+               (faulttype == VM_FAULT_READ ||
+                (lookup_valid_translation_in_hpt->PFN & TLBLO_DIRTY))) {
+                // find valid translation, load TLB
+                write_to_tlb(lookup_valid_translation_in_hpt);
+                splx(spl);
+                VMSTAT_INC(vs_refills);
+                return 0;
+            }
+            splx(spl);
+            if(lookup_valid_translation_in_hpt != NULL) {
+                return vm_cow_fault(as, vir_page_num);
+            }
         }
 
         /****** allocate frame, zero-fill, insert PTE to hpt ******/
-        void * temp = kmalloc(PAGE_SIZE);
-        vaddr_t alloc_vaddr = (vaddr_t) temp;
+        // most likely comes pre-zeroed from the zeroing thread
+        vaddr_t alloc_vaddr = alloc_kpages_flags(1, AKP_ZERO | AKP_USER);
 
         // KASSERT(alloc_vaddr != 0);
         if(alloc_vaddr == 0) {
@@ -348,8 +2053,14 @@ vm_fault(int faulttype, vaddr_t faultaddress)
         paddr_t phy_frame_number = alloc_paddr & TLBLO_PPAGE;
         // KASSERT(phy_frame_number != 0);
 
+        // a fresh frame has room for its one mapping, this can't fail
+        int result = frame_rmap_add(phy_frame_number, as, vir_page_num);
+        KASSERT(result == 0);
+
         int dirty_bit = _region->is_writeable;
 
+        // splhigh for the same reason as above
+        int spl = splhigh();
         struct hpt_entry * inserted_hpt_entry = hpt_insert(
             as, 
             vir_page_num, 
@@ -357,26 +2068,58 @@ vm_fault(int faulttype, vaddr_t faultaddress)
             DEFAULT_CACHE_BIT,
             dirty_bit, 
             DEFAULT_VALID_BIT);
+        if(inserted_hpt_entry != NULL) {
+            write_to_tlb(inserted_hpt_entry);
+        }
+        splx(spl);
 
         // KASSERT(inserted_hpt_entry != NULL);
         if(inserted_hpt_entry == NULL) {
+            frame_rmap_remove(phy_frame_number, as, vir_page_num);
+            free_kpages(alloc_vaddr);
             return ENOMEM;
         } else {
-            write_to_tlb(inserted_hpt_entry);
+            region_mark_resident(as, _region, vir_page_num);
+            VMSTAT_INC(vs_newpages);
         }
+
+        // new pages are what makes the table grow
+        hpt_rehash_step();
         
         return 0;
 }
 
 /*
  *
- * SMP-specific functions.  Unused in our configuration.
+ * SMP-specific functions.
  */
 
+/**
+*   Handle a shootdown request from vm_tlb_shootdown, in the IPI handler.
+*   A request for an ASID of an older generation has nothing left to do,
+*   the rollover flushed it.
+*/
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-        (void)ts;
-        panic("vm tried to do tlb shootdown?!\n");
+        int spl = splhigh();
+
+        if((ts->ts_asid >> ASID_BITS) == curcpu->c_asid_gen) {
+            tlb_invalidate_asid(ts->ts_asid & ASID_MASK, ts->ts_vaddr,
+                ts->ts_npages);
+        }
+        VMSTAT_INC(vs_shootdowns_recv);
+        splx(spl);
+}
+
+void
+vm_tlbshootdown_all(void)
+{
+        int spl = splhigh();
+
+        vm_tlb_flush();
+        tlb_restore_asid();
+        VMSTAT_INC(vs_shootdown_flushes);
+        splx(spl);
 }
 
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * meminfo - print physical memory use as reported by __meminfo().
+ *
+ * Prints the frames owned by each class, then touches TOUCHPAGES
+ * pages of a bss array and prints again; the process's RSS and the
+ * user frames should both have gone up by that much.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <err.h>
+
+#define PAGESIZE    4096
+#define TOUCHPAGES  64
+
+static char heap[TOUCHPAGES * PAGESIZE];
+
+static
+void
+show(void)
+{
+	struct meminfo mi;
+
+	if (__meminfo(&mi) < 0) {
+		err(1, "__meminfo");
+	}
+	printf("meminfo: %u pages of %u bytes\n", mi.mi_total,
+	       mi.mi_pagesize);
+	printf("meminfo: kernel %u, kernel heap %u, user %u, "
+	       "page tables %u, file cache %u\n", mi.mi_kernel,
+	       mi.mi_kheap, mi.mi_user, mi.mi_pgtable, mi.mi_filecache);
+	printf("meminfo: free %u (%u zeroed), this process %u resident\n",
+	       mi.mi_free, mi.mi_zeroed, mi.mi_rss);
+}
+
+int
+main(void)
+{
+	unsigned i;
+
+	show();
+	for (i=0; i<TOUCHPAGES; i++) {
+		heap[i * PAGESIZE] = 1;
+	}
+	printf("meminfo: after touching %d pages\n", TOUCHPAGES);
+	show();
+	return 0;
+}
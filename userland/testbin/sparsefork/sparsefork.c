@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * sparsefork - fork/exit benchmark for a process with a large, mostly
+ * untouched data segment.
+ *
+ * The process has a 16M array in bss and touches one page in every
+ * STRIDE, so it is big in virtual size but small in resident size.
+ * It then forks NFORKS children that exit right away, and reports the
+ * average time for one fork/exit/waitpid round trip. That time should
+ * follow the resident size of the process, not its virtual size.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+#include <sys/wait.h>
+
+#define PAGESIZE  4096
+#define NPAGES    4096		/* 16M of bss */
+#define STRIDE    256		/* touch 16 of those pages */
+#define NFORKS    200
+
+static char heap[NPAGES * PAGESIZE];
+
+static
+void
+touch(void)
+{
+	unsigned i;
+
+	for (i=0; i<NPAGES; i+=STRIDE) {
+		heap[i * PAGESIZE] = (char)i;
+	}
+}
+
+static
+void
+check(void)
+{
+	unsigned i;
+
+	for (i=0; i<NPAGES; i+=STRIDE) {
+		if (heap[i * PAGESIZE] != (char)i) {
+			_exit(1);
+		}
+	}
+}
+
+int
+main(void)
+{
+	time_t startsecs, endsecs;
+	unsigned long startnsecs, endnsecs;
+	unsigned long long usecs;
+	int i, status;
+	pid_t pid;
+
+	touch();
+
+	__time(&startsecs, &startnsecs);
+	for (i=0; i<NFORKS; i++) {
+		pid = fork();
+		if (pid < 0) {
+			err(1, "fork");
+		}
+		if (pid == 0) {
+			check();
+			_exit(0);
+		}
+		if (waitpid(pid, &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+			errx(1, "child %d saw the wrong data", i);
+		}
+	}
+	__time(&endsecs, &endnsecs);
+
+	if (endnsecs < startnsecs) {
+		endnsecs += 1000000000;
+		endsecs--;
+	}
+	usecs = (endsecs - startsecs) * 1000000ULL +
+		(endnsecs - startnsecs) / 1000;
+
+	printf("sparsefork: %u pages of bss, %u resident\n",
+	       NPAGES, NPAGES / STRIDE);
+	printf("sparsefork: %d forks, %llu us per fork/exit\n",
+	       NFORKS, usecs / NFORKS);
+	return 0;
+}